@@ -0,0 +1,150 @@
+#include "../libjarl/string.h"
+#include "../libjarl/misc.h"
+
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+
+/*
+  Times string hashing, interning, from one thread and from several, and ordering
+  comparisons. The hash is compared against the byte at a time FNV-1a it replaced.
+*/
+
+namespace {
+
+  size_t fnvHash_(const char* from, const char* to){
+    size_t ret = 0xcbf29ce484222325;
+    for(; from < to; ++from){
+      ret ^= *from;
+      ret *= 0x100000001b3;
+    }
+    return ret;
+  }
+
+  template<class F>
+  double time_(F f){
+    auto begin = std::chrono::steady_clock::now();
+    f();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(end - begin).count();
+  }
+
+  std::vector<std::string> makeKeys_(size_t num, size_t len){
+    std::vector<std::string> ret;
+    ret.reserve(num);
+    uint64_t state = 0x9e3779b97f4a7c15ull;
+    for(size_t i = 0; i < num; ++i){
+      std::string key = "key_";
+      while(key.size() < len){
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        key += static_cast<char>('a' + state % 26);
+      }
+      ret.push_back(std::move(key));
+    }
+    return ret;
+  }
+
+  void benchHash_(const std::vector<std::string>& keys, size_t len){
+    constexpr int rounds = 20;
+    size_t sink = 0;
+    double fnv = time_([&]{
+      for(int r = 0; r < rounds; ++r){
+        for(auto& key: keys){
+          sink += fnvHash_(key.data(), key.data() + key.size());
+        }
+      }
+    });
+    double current = time_([&]{
+      for(int r = 0; r < rounds; ++r){
+        for(auto& key: keys){
+          sink += defaultHash(key.data(), key.data() + key.size());
+        }
+      }
+    });
+    printf(
+      "hash, len %4zu:    fnv %8.2f ms  defaultHash %8.2f ms  (%zx)\n",
+      len, fnv, current, sink & 0xf
+    );
+  }
+
+  void benchIntern_(const std::vector<std::string>& keys, size_t len){
+    std::vector<String*> strings;
+    strings.reserve(keys.size() * 2);
+    double elapsed = time_([&]{
+      for(int r = 0; r < 2; ++r){
+        for(auto& key: keys){
+          String* str = make_new<String>(key.data(), static_cast<int>(key.size()))->intern();
+          strings.push_back(str);
+        }
+      }
+    });
+    printf("intern, len %4zu:  %8.2f ms\n", len, elapsed);
+    for(auto str: strings){
+      str->decRefCount();
+    }
+  }
+
+  //each thread interns its own keys, as separate VMs would
+  void benchInternParallel_(const std::vector<std::string>& keys, size_t len){
+    unsigned num_threads = std::max(2u, std::thread::hardware_concurrency());
+    std::vector<std::vector<String*>> strings(num_threads);
+    double elapsed = time_([&]{
+      std::vector<std::thread> threads;
+      for(unsigned t = 0; t < num_threads; ++t){
+        threads.emplace_back([&, t]{
+          for(size_t i = t; i < keys.size(); i += num_threads){
+            auto& key = keys[i];
+            String* str = make_new<String>(key.data(), static_cast<int>(key.size()))->intern();
+            strings[t].push_back(str);
+          }
+        });
+      }
+      for(auto& thread: threads){
+        thread.join();
+      }
+    });
+    printf("intern, len %4zu, %u threads: %8.2f ms\n", len, num_threads, elapsed);
+    for(auto& thread_strings: strings){
+      for(auto str: thread_strings){
+        str->decRefCount();
+      }
+    }
+  }
+
+  void benchSort_(const std::vector<std::string>& keys, size_t len){
+    std::vector<String*> strings;
+    strings.reserve(keys.size());
+    for(auto& key: keys){
+      String* str = make_new<String>(key.data(), static_cast<int>(key.size()));
+      str->incRefCount();
+      strings.push_back(str);
+    }
+    double elapsed = time_([&]{
+      std::sort(strings.begin(), strings.end(), [](const String* lhs, const String* rhs){
+        return lhs->cmp(*rhs) < 0;
+      });
+    });
+    printf("sort, len %4zu:    %8.2f ms\n", len, elapsed);
+    for(auto str: strings){
+      str->decRefCount();
+    }
+  }
+}
+
+int main(){
+  constexpr size_t num = 200000;
+  for(size_t len: {8, 16, 32, 128, 1024}){
+    auto keys = makeKeys_(len > 128? num / 8 : num, len);
+    benchHash_(keys, len);
+    benchIntern_(keys, len);
+    benchInternParallel_(keys, len);
+    benchSort_(keys, len);
+  }
+  return 0;
+}
@@ -3,12 +3,14 @@
 
 /*
   This class allows for monitoring of allocations/deallocations and listing all
-  objects. Used for debugging.
+  objects. Used for debugging. Objects may be allocated and deallocated on any
+  thread.
 */
 
 #include <vector>
 #include <algorithm>
 #include <functional>
+#include <mutex>
 
 enum class AllocMsg{
   Allocation,
@@ -23,10 +25,12 @@ struct AllocMonitor{
   
   std::vector<const Type*> allocations;
   CallbackType callback;
+  std::mutex mutex;
   
   AllocMonitor(CallbackType&& cb): callback(cb){}
   
   void push(const Type* alloc){
+    std::lock_guard<std::mutex> lock(this->mutex);
     auto it = std::find(this->allocations.begin(), this->allocations.end(), alloc);
     if(it != this->allocations.end()){
       callback(AllocMsg::DoubleAllocation, alloc);
@@ -36,6 +40,7 @@ struct AllocMonitor{
     allocations.push_back(alloc);
   }
   void pop(const Type* alloc){
+    std::lock_guard<std::mutex> lock(this->mutex);
     auto it = std::find(this->allocations.begin(), this->allocations.end(), alloc);
     if(it == this->allocations.end()){
       callback(AllocMsg::InvalidFree, alloc);
@@ -10,18 +10,200 @@
 #undef MONITOR_ARRAY_ALLOCS
 #endif
 
+Array::Array(): offset_(0), size_(0){}
+
+Array::Array(size_t num): offset_(0), size_(num){
+  if(num <= ChunkSize){
+    this->flat_.resize(num);
+    return;
+  }
+  this->chunks_.reserve((num + ChunkSize - 1) / ChunkSize);
+  for(size_t i = 0; i < num; i += ChunkSize){
+    this->appendChunk_();
+  }
+}
+
+Array::Array(const Array& other)
+: flat_(other.flat_), chunks_(other.chunks_), offset_(other.offset_), size_(other.size_){
+  for(auto chunk: this->chunks_){
+    chunk->incRefCount();
+  }
+}
+
+Array::~Array(){
+  for(auto chunk: this->chunks_){
+    chunk->decRefCount();
+  }
+}
+
+Array::Chunk_* Array::uniqueChunk_(size_t chunk_idx){
+  Chunk_* chunk = this->chunks_[chunk_idx];
+  if(chunk->getRefCount() > 1){
+    Chunk_* copy = new Chunk_;
+    size_t first = chunk_idx == 0? this->offset_ : 0;
+    size_t last = std::min(ChunkSize, this->offset_ + this->size_ - chunk_idx * ChunkSize);
+    std::copy(chunk->values + first, chunk->values + last, copy->values + first);
+    copy->incRefCount();
+    chunk->decRefCount();
+    this->chunks_[chunk_idx] = copy;
+    chunk = copy;
+  }
+  return chunk;
+}
+
+void Array::appendChunk_(){
+  Chunk_* chunk = new Chunk_;
+  chunk->incRefCount();
+  this->chunks_.push_back(chunk);
+}
+
+/*
+  Moves the elements of a flat array to chunks, once it grows past ChunkSize.
+*/
+void Array::toChunks_(){
+  this->chunks_.reserve((this->size_ + ChunkSize) / ChunkSize);
+  for(size_t i = 0; i < this->size_; i += ChunkSize){
+    this->appendChunk_();
+    std::move(
+      this->flat_.begin() + i,
+      this->flat_.begin() + std::min(i + ChunkSize, this->size_),
+      this->chunks_.back()->values
+    );
+  }
+  std::vector<TypedValue>().swap(this->flat_);
+}
+
+void Array::reserve(size_t num){
+  if(this->chunks_.empty() && num <= ChunkSize){
+    this->flat_.reserve(num);
+  }else{
+    this->chunks_.reserve((this->offset_ + num + ChunkSize - 1) / ChunkSize);
+  }
+}
+
+void Array::push_back(const TypedValue& val){
+  if(this->chunks_.empty()){
+    if(this->size_ == ChunkSize){
+      // val may be an element of this array, so it is copied before they move
+      this->push_back(TypedValue(val));
+      return;
+    }
+    this->flat_.push_back(val);
+    ++this->size_;
+    return;
+  }
+  size_t pos = this->offset_ + this->size_;
+  if(pos / ChunkSize == this->chunks_.size()){
+    this->appendChunk_();
+    this->chunks_.back()->values[0] = val;
+  }else{
+    this->uniqueChunk_(pos / ChunkSize)->values[pos % ChunkSize] = val;
+  }
+  ++this->size_;
+}
+
+void Array::push_back(TypedValue&& val){
+  if(this->chunks_.empty()){
+    if(this->size_ < ChunkSize){
+      this->flat_.push_back(std::move(val));
+      ++this->size_;
+      return;
+    }
+    this->toChunks_();
+  }
+  size_t pos = this->offset_ + this->size_;
+  if(pos / ChunkSize == this->chunks_.size()){
+    this->appendChunk_();
+    this->chunks_.back()->values[0] = std::move(val);
+  }else{
+    this->uniqueChunk_(pos / ChunkSize)->values[pos % ChunkSize] = std::move(val);
+  }
+  ++this->size_;
+}
+
+void Array::push_front(TypedValue&& val){
+  Array tmp;
+  tmp.reserve(this->size_ + 1);
+  tmp.push_back(std::move(val));
+  tmp.append(*this);
+  std::swap(this->flat_, tmp.flat_);
+  std::swap(this->chunks_, tmp.chunks_);
+  std::swap(this->offset_, tmp.offset_);
+  std::swap(this->size_, tmp.size_);
+}
+
+void Array::append(const Array& other){
+  if(&other == this){
+    Array copy(other);
+    this->append(copy);
+    return;
+  }
+  if(this->chunks_.empty()){
+    if(this->size_ + other.size_ <= ChunkSize){
+      this->flat_.reserve(this->size_ + other.size_);
+      for(const auto& val: other){
+        this->flat_.push_back(val);
+      }
+      this->size_ += other.size_;
+      return;
+    }
+    if(this->size_ > 0) this->toChunks_();
+  }
+  size_t end = this->offset_ + this->size_;
+  if(
+    !other.chunks_.empty()
+    && end == this->chunks_.size() * ChunkSize
+    && other.offset_ == 0
+  ){
+    // chunk aligned, so the chunks of other can be shared as they are
+    this->chunks_.insert(this->chunks_.end(), other.chunks_.begin(), other.chunks_.end());
+    for(auto chunk: other.chunks_){
+      chunk->incRefCount();
+    }
+    this->size_ += other.size_;
+  }else{
+    this->reserve(this->size_ + other.size_);
+    for(const auto& val: other){
+      this->push_back(val);
+    }
+  }
+}
+
+void Array::clear(){
+  for(auto chunk: this->chunks_){
+    chunk->decRefCount();
+  }
+  this->chunks_.clear();
+  this->flat_.clear();
+  this->offset_ = 0;
+  this->size_ = 0;
+}
+
 Array* Array::slice(int first, int second) const{
   Array* res = new Array;
-  res->reserve(second - first);
-  std::copy(this->begin() + first, this->begin() + second, std::back_inserter(*res));
+  
+  if(this->chunks_.empty() || second - first < (int)ChunkSize){
+    // a short slice is cheaper to copy than to keep its chunks alive
+    res->reserve(second - first);
+    for(int i = first; i < second; ++i){
+      res->push_back((*this)[i]);
+    }
+  }else{
+    size_t begin = this->offset_ + first;
+    size_t end = this->offset_ + second;
+    res->chunks_.assign(
+      this->chunks_.begin() + begin / ChunkSize,
+      this->chunks_.begin() + (end + ChunkSize - 1) / ChunkSize
+    );
+    for(auto chunk: res->chunks_){
+      chunk->incRefCount();
+    }
+    res->offset_ = begin % ChunkSize;
+    res->size_ = second - first;
+  }
   return res;
 }
 
-void Array::sliceInline(int first, int second){
-  this->erase(this->begin() + second, this->end());
-  this->erase(this->begin(), this->begin() + first);
-}
-
 #ifndef NDEBUG
 std::string Array::toStrDebug()const{
   std::string ret = "[";
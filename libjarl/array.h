@@ -3,6 +3,7 @@
 
 #include "rc_mixin.h"
 #include "value.h"
+#include "object_pools.h"
 
 #include <vector>
 #include <algorithm>
@@ -20,37 +21,163 @@ class Array;
 extern AllocMonitor<Array> array_alloc_monitor;
 #endif
 
+/*
+  Persistent array. Arrays of up to ChunkSize elements are stored flat. Larger
+  arrays store their elements in reference counted chunks of ChunkSize values,
+  and hold a flat list of pointers to their chunks. Copying such an array only
+  copies the chunk list, the chunks themselves are shared and copied on first
+  write. This keeps copy on write arrays cheap to clone when only a few elements
+  are modified.
+
+  Slices share the chunks of the array they are taken from, and start at an offset
+  into their first chunk. Only short slices are copied.
+
+  Elements are contiguous within a chunk. Kernels that want to operate on raw
+  memory should walk the array in runs, see data() and runLength().
+*/
 class Array:
-  public std::vector<TypedValue>
-, public RcDirectMixin<Array>
+  public RcDirectMixin<Array>
 #ifndef NDEBUG
 , public MonitoredMixin<Array, array_alloc_monitor>
 #endif
 {
 public:
-  
-  using std::vector<TypedValue>::vector;
-  
+
+  static constexpr size_t ChunkSize = 32;
+
+private:
+
+  struct Chunk_: public RcDirectMixin<Chunk_> {
+    TypedValue values[ChunkSize];
+
+    static void* operator new(size_t size){
+      return ObjectPools::allocate(size);
+    }
+    void operator delete(void* ptr){
+      ObjectPools::deallocate(ptr);
+    }
+  };
+
+  // the elements while chunks_ is empty
+  std::vector<TypedValue> flat_;
+  std::vector<Chunk_*> chunks_;
+  size_t offset_;
+  size_t size_;
+
+  Chunk_* uniqueChunk_(size_t);
+  void appendChunk_();
+  void toChunks_();
+
+public:
+
+  class const_iterator{
+    const Array* arr_;
+    size_t idx_;
+
+  public:
+    typedef std::random_access_iterator_tag iterator_category;
+    typedef TypedValue value_type;
+    typedef ptrdiff_t difference_type;
+    typedef const TypedValue* pointer;
+    typedef const TypedValue& reference;
+
+    const_iterator(const Array* arr, size_t idx): arr_(arr), idx_(idx){}
+
+    const TypedValue& operator*()const{return (*this->arr_)[this->idx_];}
+    const TypedValue* operator->()const{return &(*this->arr_)[this->idx_];}
+    const_iterator& operator++(){
+      ++this->idx_;
+      return *this;
+    }
+    const_iterator operator+(ptrdiff_t n)const{
+      return const_iterator(this->arr_, this->idx_ + n);
+    }
+    ptrdiff_t operator-(const const_iterator& other)const{
+      return this->idx_ - other.idx_;
+    }
+    bool operator==(const const_iterator& other)const{
+      return this->idx_ == other.idx_;
+    }
+    bool operator!=(const const_iterator& other)const{
+      return this->idx_ != other.idx_;
+    }
+  };
+
+  Array();
+  explicit Array(size_t);
+  Array(const Array&);
+  ~Array();
+
+  void operator=(const Array&) = delete;
+
+  static void* operator new(size_t size){
+    return ObjectPools::allocate(size);
+  }
   void operator delete(void* ptr){
-    ::operator delete(ptr);
+    ObjectPools::deallocate(ptr);
   }
-  
-  Array* slice(int, int) const;
-  void sliceInline(int, int);
-  
-  std::vector<TypedValue>::const_iterator begin()const{
-    return this->std::vector<TypedValue>::begin();
+
+  size_t size()const{
+    return this->size_;
   }
-  std::vector<TypedValue>::const_iterator end()const{
-    return this->std::vector<TypedValue>::end();
+  bool empty()const{
+    return this->size_ == 0;
   }
-  std::vector<TypedValue>::iterator begin(){
-    return this->std::vector<TypedValue>::begin();
+
+  const TypedValue& operator[](size_t idx)const{
+    if(this->chunks_.empty()) return this->flat_[idx];
+    idx += this->offset_;
+    return this->chunks_[idx / ChunkSize]->values[idx % ChunkSize];
   }
-  std::vector<TypedValue>::iterator end(){
-    return this->std::vector<TypedValue>::end();
+  /*
+    Returns a reference that may be written to. The chunk holding the element is
+    copied first if it is shared with another array.
+  */
+  TypedValue& getMutable(size_t idx){
+    if(this->chunks_.empty()) return this->flat_[idx];
+    idx += this->offset_;
+    return this->uniqueChunk_(idx / ChunkSize)->values[idx % ChunkSize];
+  }
+
+  /*
+    Pointers to the element at idx. The runLength(idx) elements starting at idx
+    are contiguous in memory.
+  */
+  const TypedValue* data(size_t idx)const{
+    return &(*this)[idx];
   }
-  
+  TypedValue* mutableData(size_t idx){
+    return &this->getMutable(idx);
+  }
+  size_t runLength(size_t idx)const{
+    if(this->chunks_.empty()) return this->size_ - idx;
+    return std::min(ChunkSize - (this->offset_ + idx) % ChunkSize, this->size_ - idx);
+  }
+
+  void reserve(size_t);
+
+  void push_back(const TypedValue&);
+  void push_back(TypedValue&&);
+  template<class... P>
+  void emplace_back(P&&... p){
+    this->push_back(TypedValue(std::forward<P>(p)...));
+  }
+  void push_front(TypedValue&&);
+  void append(const Array&);
+  /*
+    Removes all elements. A flat array keeps its storage.
+  */
+  void clear();
+
+  Array* slice(int, int) const;
+
+  const_iterator begin()const{
+    return const_iterator(this, 0);
+  }
+  const_iterator end()const{
+    return const_iterator(this, this->size_);
+  }
+
   #ifndef NDEBUG
   std::string toStrDebug()const;
   #endif
@@ -71,8 +198,8 @@ inline Array* constructArray(Array* arr, TypedValue&& val, T... args){
 }
 template<class... T>
 inline Array* constructArray(Array* arr, const Array& other, T... args){
-  std::copy(other.begin(), other.end(), std::back_inserter(*arr));
+  arr->append(other);
   return constructArray(arr, args...);
 }
 
-#endif
\ No newline at end of file
+#endif
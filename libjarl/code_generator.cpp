@@ -1,8 +1,12 @@
 #include "function.h"
 
 #include "code_generator.h"
+#include "code_optimizer.h"
+#include "array.h"
+#include "table.h"
 
 #include <limits>
+#include <algorithm>
 
 #ifndef NDEBUG
 #include <cstdio>
@@ -12,21 +16,27 @@
 #endif
 
 using namespace CodeGenerator;
+using namespace CodeOptimizer;
 
-constexpr OpCodes::Type stack_pos_bits     = 0xe000;
-constexpr OpCodes::Type stack_pos_arg      = 0x0000;
-constexpr OpCodes::Type stack_pos_local    = 0x8000;
-constexpr OpCodes::Type stack_pos_const    = 0x4000;
-constexpr OpCodes::Type stack_pos_capture  = 0x2000;
-
-struct ThreadingContext {
-  std::vector<OpCodes::Type> code;
-  std::vector<std::pair<int, int>> code_positions;
-  
+struct ThreadingContext: TaggedCode {
   VarAllocMap *var_allocs, *context_var_allocs;
+  // the scope between the arguments and the body, see copied_captures
+  VarAllocMap* function_scope;
   VectorSet<TypedValue> constants;
   
-  unsigned arguments, captures, locals;
+  unsigned captures, scratch;
+  
+  // the variables borrowed by the assignments being threaded
+  std::vector<OpCodes::Type> borrowed;
+  // variables that hold the function they are declared with, see threadInline
+  std::vector<std::pair<OpCodes::Type, const Function*>> inlinable;
+  const std::vector<std::pair<OpCodes::Type, const Function*>>* context_inlinable;
+  // the locals the inlined calls share, see threadInline
+  unsigned inline_base, inline_size;
+  // names that are assigned, or declared more than once, in the function
+  std::vector<String*> reassigned;
+  // captures that are reassigned, each with the local it is copied to on entry
+  std::vector<std::pair<OpCodes::Type, OpCodes::Type>> copied_captures;
   
   std::vector<std::unique_ptr<char[]>> *errors;
   
@@ -38,18 +48,29 @@ struct ThreadingContext {
     unsigned caps = 0,
     unsigned locs = 0
   )
-  : var_allocs(std::move(va)),
+  : TaggedCode(args, locs),
+    var_allocs(std::move(va)),
     context_var_allocs(cva),
+    function_scope(nullptr),
+    context_inlinable(nullptr),
     errors(err),
-    arguments(args),
     captures(caps),
-    locals(locs){}
+    scratch(0),
+    inline_base(0),
+    inline_size(0){}
   
   void putInstruction(OpCodes::Type op, int pos);
   
   void threadAST(ASTNode*, ASTNode* = nullptr);
+  void threadTemporary(ASTNode* node, ASTNode* prev_node);
+  void threadAggregate(ASTNode* node, bool temporary);
+  void threadApply(ASTNode* node);
   void threadRexpr(ASTNode* node, ASTNode* prev_node);
   void threadInsRexpr(ASTNode* node, ASTNode* prev_node);
+  void borrowVariable(ASTNode* lvalue);
+  OpCodes::Type threadArguments(ASTNode* args, ASTNode* prev_node);
+  const Function* inlinableCallee(ASTNode* callee);
+  void threadInline(ASTNode* node, const Function* func);
   
 private:
   class AllocContextGuard {
@@ -73,11 +94,160 @@ public:
 
 namespace {
   
+  /*
+    Calls to a function that is small enough, has no captures and does not loop
+    are replaced by its code. The function must end in its only return, and every
+    instruction of it must have a known effect on the stack, with one value left
+    when it returns.
+  */
+  constexpr unsigned inline_limit = 32;
+  
+  bool inlinable_(const Function* func){
+    const auto& code = func->getVCode();
+    if(func->captures > 0 || func->scratch > 0 || code.size() > inline_limit){
+      return false;
+    }
+    
+    // the depth of the stack before each instruction, jumps only go forward
+    std::vector<int> depth(code.size() + 1, -1);
+    depth[0] = 0;
+    auto reach = [&depth](unsigned ip, int d){
+      if(d < 0 || (depth[ip] >= 0 && depth[ip] != d)) return false;
+      depth[ip] = d;
+      return true;
+    };
+    
+    for(unsigned ip = 0; ip < code.size(); ip += instructionSize(code[ip])){
+      const OpCodes::Type op = code[ip];
+      const OpCodes::Type head = op & OpCodes::Head;
+      const unsigned next = ip + instructionSize(op);
+      const int d = depth[ip];
+      if(d < 0) return false;
+      
+      int after;
+      switch(op & ~OpCodes::Head){
+      case OpCodes::Push:
+      case OpCodes::PushTrue:
+      case OpCodes::PushFalse:
+        after = d + 1;
+        break;
+      case OpCodes::Write:
+        if(head != OpCodes::Extended) return false;
+        after = d - 1;
+        break;
+      case OpCodes::Neg:
+      case OpCodes::Not:
+      case OpCodes::Nop:
+        if(head != 0) return false;
+        after = d;
+        break;
+      case OpCodes::Pop:
+      case OpCodes::Add:
+      case OpCodes::Sub:
+      case OpCodes::Mul:
+      case OpCodes::Div:
+      case OpCodes::Mod:
+      case OpCodes::Append:
+      case OpCodes::Cmp:
+      case OpCodes::Eq:
+      case OpCodes::Neq:
+      case OpCodes::Gt:
+      case OpCodes::Lt:
+      case OpCodes::Geq:
+      case OpCodes::Leq:
+      case OpCodes::In:
+      case OpCodes::Get:
+      case OpCodes::Apply:
+        if(head != 0) return false;
+        after = d - 1;
+        break;
+      case OpCodes::Slice:
+        if(head != 0) return false;
+        after = d - 2;
+        break;
+      case OpCodes::Call:
+        if(head == 0) after = d;
+        else if(head == OpCodes::Extended) after = d - code[ip + 1];
+        else return false;
+        break;
+      case OpCodes::Jmp:
+        if(code[ip + 1] <= ip || !reach(code[ip + 1], d)) return false;
+        continue;
+      case OpCodes::Jt:
+      case OpCodes::Jf:
+        if(code[ip + 1] <= ip || !reach(code[ip + 1], d - 1)) return false;
+        after = d - 1;
+        break;
+      case OpCodes::Jtsc:
+      case OpCodes::Jfsc:
+        if(code[ip + 1] <= ip || !reach(code[ip + 1], d)) return false;
+        after = d - 1;
+        break;
+      case OpCodes::Return:
+        return next == code.size() && d == 1;
+      default:
+        return false;
+      }
+      if(after < 0 || !reach(next, after)) return false;
+    }
+    return false;
+  }
+  
+  // the root variable of an assigned expression
+  ASTNode* assignedVariable_(ASTNode* lvalue){
+    while(lvalue->type == ASTNodeType::Index) lvalue = lvalue->children.first;
+    return lvalue->type == ASTNodeType::Identifier? lvalue : nullptr;
+  }
+  
+  /*
+    Collects the names that may not keep the value they are declared with, the
+    ones assigned and the ones declared more than once, nested functions
+    included.
+  */
+  void collectReassigned_(
+    ASTNode* node,
+    std::vector<String*>& declared,
+    std::vector<String*>& reassigned
+  ){
+    if(node == nullptr) return;
+    ASTNode* target = nullptr;
+    if(node->type == ASTNodeType::Var){
+      // the declaration is an assignment to the name, which is not counted
+      String* name = node->child->children.first->string_value;
+      if(std::find(declared.begin(), declared.end(), name) != declared.end()){
+        reassigned.push_back(name);
+      }else{
+        declared.push_back(name);
+      }
+      collectReassigned_(node->child->children.second, declared, reassigned);
+      return;
+    }else if((static_cast<unsigned>(node->type) & ~0xff)
+    == static_cast<unsigned>(ASTNodeType::AssignExpr)){
+      target = assignedVariable_(node->children.first);
+    }else if(node->type == ASTNodeType::Move){
+      target = assignedVariable_(node->child);
+    }
+    if(target != nullptr) reassigned.push_back(target->string_value);
+    
+    switch(static_cast<ASTNodeType>(static_cast<unsigned>(node->type) & ~0xfff)){
+    case ASTNodeType::OneChild:
+      collectReassigned_(node->child, declared, reassigned);
+      break;
+    case ASTNodeType::TwoChildren:
+      collectReassigned_(node->children.first, declared, reassigned);
+      collectReassigned_(node->children.second, declared, reassigned);
+      break;
+    default:
+      break;
+    }
+  }
+  
   Function* generate_(
     std::unique_ptr<ASTNode>&& parse_tree,
     std::vector<std::unique_ptr<char[]>>* errors,
     VarAllocMap* var_allocs,
-    VarAllocMap* context_var_allocs = nullptr
+    VarAllocMap* context_var_allocs = nullptr,
+    const std::vector<std::pair<OpCodes::Type, const Function*>>* context_inlinable = nullptr
   ){
     assert(var_allocs != nullptr);
     
@@ -87,20 +257,46 @@ namespace {
       context_var_allocs,
       var_allocs->size()
     );
+    context.context_inlinable = context_inlinable;
+    {
+      std::vector<String*> declared;
+      collectReassigned_(parse_tree.get(), declared, context.reassigned);
+    }
     
     int prev_errors = errors->size();
     auto pos = parse_tree->pos.first;
     context.code_positions.emplace_back(pos, 0);
-    context.threadAST(parse_tree.get());
+    {
+      auto scope = context.newScope();
+      context.function_scope = context.var_allocs;
+      context.threadAST(parse_tree.get());
+    }
     if(errors->size() > prev_errors) return nullptr;
     context.putInstruction(OpCodes::Return, pos);
     
-    //correct stack positions
+    if(!context.copied_captures.empty()){
+      std::vector<OpCodes::Type> entry;
+      for(auto& copy: context.copied_captures){
+        entry.insert(entry.end(), {
+          OpCodes::Push | OpCodes::Extended, copy.first,
+          OpCodes::Write | OpCodes::Extended, copy.second
+        });
+      }
+      prependCode(context, entry);
+    }
+    
+    uint64_t borrowable = optimize(context);
+    
+    /*
+      correct stack positions
+      captures are not on the stack but in the environment of the closure, and
+      are only ever read, so their pushes become PushCapture of the index
+    */
     int extended = 0;
-    const int capture_pos = context.arguments;
-    const int const_pos   = capture_pos + context.captures;
+    const int const_pos   = context.arguments;
     const int local_pos   = const_pos + context.constants.size();
-    for(auto& op: context.code){
+    for(unsigned ip = 0; ip < context.code.size(); ++ip){
+      auto& op = context.code[ip];
       if(extended == 0){
         if(op & OpCodes::Extended){
           if(op & OpCodes::Int) extended = 1;
@@ -113,7 +309,9 @@ namespace {
         extended -= 2;
         switch(op & stack_pos_bits){
         case stack_pos_capture:
-          op = (op & ~stack_pos_capture) + capture_pos;
+          assert((context.code[ip - 1] & ~OpCodes::Head) == OpCodes::Push);
+          context.code[ip - 1] = OpCodes::PushCapture | OpCodes::Extended;
+          op = op & ~stack_pos_capture;
           break;
         case stack_pos_const:
           op = (op & ~stack_pos_const) + const_pos;
@@ -131,7 +329,9 @@ namespace {
       std::move(context.code_positions),
       context.arguments,
       context.captures,
-      context.locals
+      context.locals,
+      context.scratch,
+      borrowable
     );
     
     #ifdef PRINT_CODE
@@ -230,8 +430,25 @@ void ThreadingContext::threadAST(ASTNode* node, ASTNode* prev_node){
           
           auto pos = (captures++) | stack_pos_capture;
           var_allocs->base()[node->string_value] = pos;
+          /*
+            The environment is shared by every call of the closure, so a capture
+            the function assigns is copied to a local when it is entered, and the
+            local is used in its place.
+          */
+          if(
+            std::find(reassigned.begin(), reassigned.end(), node->string_value)
+            != reassigned.end()
+          ){
+            auto local = (locals++) | stack_pos_local;
+            function_scope->direct()[node->string_value] = local;
+            copied_captures.emplace_back(pos, local);
+            pos = local;
+          }
           D_putInstruction(pos);
         }else{
+          if(std::find(borrowed.begin(), borrowed.end(), it->second) != borrowed.end()){
+            pinned.push_back(code.size() - 1);
+          }
           D_putInstruction(it->second);
         }
       }
@@ -246,7 +463,10 @@ void ThreadingContext::threadAST(ASTNode* node, ASTNode* prev_node){
     
   case ASTNodeType::UnaryExpr:
     if(node->type == ASTNodeType::Move){
+      auto borrows = borrowed.size();
+      borrowVariable(node->child);
       threadRexpr(node->child, node);
+      borrowed.resize(borrows);
       D_putInstruction(OpCodes::Move | OpCodes::Borrowed);
     }else{
       threadAST(node->child, node);
@@ -268,13 +488,17 @@ void ThreadingContext::threadAST(ASTNode* node, ASTNode* prev_node){
     break;
     
   case ASTNodeType::BinaryExpr:
+    if(node->type == ASTNodeType::Apply){
+      threadApply(node);
+      break;
+    }
     threadAST(node->children.first, node);
-    threadAST(node->children.second, node);
+    if(node->type == ASTNodeType::In){
+      threadTemporary(node->children.second, node);
+    }else{
+      threadAST(node->children.second, node);
+    }
     switch(node->type){
-    case ASTNodeType::Apply:
-      D_putInstruction(OpCodes::Apply);
-      break;
-      
     case ASTNodeType::Add:
       D_putInstruction(OpCodes::Add);
       break;
@@ -389,12 +613,36 @@ void ThreadingContext::threadAST(ASTNode* node, ASTNode* prev_node){
     
   case ASTNodeType::AssignExpr:
     {
+      if(node->type == ASTNodeType::Assign
+      && node->children.first->type == ASTNodeType::Identifier){
+        // assigning a variable overwrites it, there is nothing to borrow
+        auto it = var_allocs->find(node->children.first->string_value);
+        if(it == var_allocs->end()){
+          D_breakErrorVargs("Undeclared identifier '%s'", node,
+            node->children.first->string_value->str()
+          );
+        }
+        // assigned captures are copied to locals, see copied_captures
+        assert((it->second & stack_pos_bits) != stack_pos_capture);
+        threadAST(node->children.second, node);
+        D_putInstruction(OpCodes::Write | OpCodes::Extended);
+        D_putInstruction(it->second);
+        break;
+      }
+      
+      /*
+        The borrowed variable is written through a pointer when the assignment
+        completes, so reading it on the way may not move it.
+      */
+      auto borrows = borrowed.size();
+      borrowVariable(node->children.first);
       if(node->type == ASTNodeType::Insert){
         threadInsRexpr(node->children.first, node);
       }else{
         threadRexpr(node->children.first, node);
       }
       threadAST(node->children.second, node);
+      borrowed.resize(borrows);
       
       switch(node->type){
       case ASTNodeType::Assign:
@@ -435,37 +683,8 @@ void ThreadingContext::threadAST(ASTNode* node, ASTNode* prev_node){
       break;
       
     case ASTNodeType::Array:
-      if(node->child->type == ASTNodeType::Nop){
-        D_putInstruction(OpCodes::CreateArray);
-      }else{
-        OpCodes::Type elems = 0;
-        for(auto it = node->child->exprListIterator(); it != nullptr; ++it){
-          if(it->type == ASTNodeType::Nop) continue;
-          threadAST(it.get(), node);
-          ++elems;
-        }
-        D_putInstruction(OpCodes::CreateArray | OpCodes::Extended | OpCodes::Int);
-        D_putInstruction(elems);
-      }
-      break;
-    
     case ASTNodeType::Table:
-      if(node->child->type == ASTNodeType::Nop){
-        D_putInstruction(OpCodes::CreateTable);
-      }else{
-        OpCodes::Type elems = 0;
-        for(auto it = node->child->exprListIterator(); it != nullptr; ++it){
-          if(it->type == ASTNodeType::KeyValuePair){
-            threadAST(it->children.first, node);
-            threadAST(it->children.second, node);
-            ++elems;
-          }else if(it->type == ASTNodeType::Nop){
-            continue;
-          }else assert(false);
-        }
-        D_putInstruction(OpCodes::CreateTable | OpCodes::Extended | OpCodes::Int);
-        D_putInstruction(elems);
-      }
+      threadAggregate(node, false);
       break;
       
     case ASTNodeType::While:
@@ -501,7 +720,7 @@ void ThreadingContext::threadAST(ASTNode* node, ASTNode* prev_node){
           }
           var_allocs->direct()[stepper->children.first->string_value] = second_pos;
           
-          threadAST(stepper->children.second, node);
+          threadTemporary(stepper->children.second, node);
           D_putInstruction(OpCodes::BeginIter | OpCodes::Extended | OpCodes::Extended2);
           D_putInstruction(first_pos);
           D_putInstruction(second_pos);
@@ -532,7 +751,7 @@ void ThreadingContext::threadAST(ASTNode* node, ASTNode* prev_node){
         
         auto func = generate_(
           std::unique_ptr<ASTNode>(node->children.second),
-          errors, var_alloc, var_allocs
+          errors, var_alloc, var_allocs, &inlinable
         );
         if(func == nullptr){
           D_putInstruction(OpCodes::Nop);
@@ -549,8 +768,17 @@ void ThreadingContext::threadAST(ASTNode* node, ASTNode* prev_node){
             D_putInstruction(OpCodes::Push | OpCodes::Extended);
             D_putInstruction((*var_allocs)[base[i + args].first]);
           }
-          D_putInstruction(OpCodes::CreateClosure | OpCodes::Extended | OpCodes::Int);
-          D_putInstruction((OpCodes::Type)func->captures);
+          // the operands are not tagged as stack positions, see threadAggregate
+          if(func->captures < stack_pos_capture && scratch < stack_pos_capture){
+            D_putInstruction(
+              OpCodes::CreateClosure | OpCodes::Extended | OpCodes::Extended2 | OpCodes::Alt1
+            );
+            D_putInstruction((OpCodes::Type)func->captures);
+            D_putInstruction(static_cast<OpCodes::Type>(scratch++));
+          }else{
+            D_putInstruction(OpCodes::CreateClosure | OpCodes::Extended | OpCodes::Int);
+            D_putInstruction((OpCodes::Type)func->captures);
+          }
         }
         
         delete var_alloc;
@@ -573,12 +801,31 @@ void ThreadingContext::threadAST(ASTNode* node, ASTNode* prev_node){
         auto it = var_allocs->direct()
           .find(subnode->children.first->string_value);
         OpCodes::Type stack_pos;
-        if(it == var_allocs->direct().end()){
+        // declaring a captured variable shadows it from here on
+        if(
+          it == var_allocs->direct().end()
+          || (it->second & stack_pos_bits) == stack_pos_capture
+        ){
           stack_pos = (locals++) | stack_pos_local;
           var_allocs->direct()[subnode->children.first->string_value] = stack_pos;
         }else{
           stack_pos = it->second;
         }
+        
+        // a function literal the variable keeps may be inlined where it is called
+        String* name = subnode->children.first->string_value;
+        if(
+          subnode->children.second->type == ASTNodeType::Function
+          && code.size() >= 2
+          && code[code.size() - 2] == (OpCodes::Push | OpCodes::Extended)
+          && (code.back() & stack_pos_bits) == stack_pos_const
+          && std::find(reassigned.begin(), reassigned.end(), name) == reassigned.end()
+        ){
+          const TypedValue& value = constants.at(code.back() & ~stack_pos_const);
+          if(value.type == TypeTag::Func && inlinable_(value.value.func_v)){
+            inlinable.emplace_back(stack_pos, value.value.func_v);
+          }
+        }
         D_putInstruction(OpCodes::Write | OpCodes::Extended);
         D_putInstruction(stack_pos);
       }
@@ -594,12 +841,7 @@ void ThreadingContext::threadAST(ASTNode* node, ASTNode* prev_node){
       if(node->child->type == ASTNodeType::Nop){
         D_putInstruction(OpCodes::Recurse);
       }else{
-        OpCodes::Type elems = 0;
-        for(auto it = node->child->exprListIterator(); it != nullptr; ++it){
-          if(it->type == ASTNodeType::Nop) continue;
-          threadAST(it.get(), node);
-          ++elems;
-        }
+        OpCodes::Type elems = threadArguments(node->child, node);
         D_putInstruction(OpCodes::Recurse | OpCodes::Extended);
         D_putInstruction(elems);
       }
@@ -634,7 +876,7 @@ void ThreadingContext::threadAST(ASTNode* node, ASTNode* prev_node){
       
     case ASTNodeType::Index:
       {
-        threadAST(node->children.first, node);
+        threadTemporary(node->children.first, node);
         
         if(node->children.second->type == ASTNodeType::ExprList){
           threadAST(node->children.second->children.first, node);
@@ -648,16 +890,21 @@ void ThreadingContext::threadAST(ASTNode* node, ASTNode* prev_node){
       break;
       
     case ASTNodeType::Call:
+      if(auto func = inlinableCallee(node->children.first)){
+        unsigned args = 0;
+        for(auto it = node->children.second->exprListIterator(); it != nullptr; ++it){
+          if(it->type != ASTNodeType::Nop) ++args;
+        }
+        if(args == func->arguments){
+          threadInline(node, func);
+          break;
+        }
+      }
       threadAST(node->children.first, node);
       if(node->children.second->type == ASTNodeType::Nop){
         D_putInstruction(OpCodes::Call);
       }else{
-        OpCodes::Type elems = 0;
-        for(auto it = node->children.second->exprListIterator(); it != nullptr; ++it){
-          if(it->type == ASTNodeType::Nop) continue;
-          threadAST(it.get(), node);
-          ++elems;
-        }
+        OpCodes::Type elems = threadArguments(node->children.second, node);
         D_putInstruction(OpCodes::Call | OpCodes::Extended);
         D_putInstruction(elems);
       }
@@ -673,6 +920,207 @@ void ThreadingContext::threadAST(ASTNode* node, ASTNode* prev_node){
   }
 }
 
+/*
+  Threads an expression whose value is only read by the instruction consuming it:
+  the right operand of in, the source of a for loop, or an indexed value. No
+  reference to it survives the consuming instruction, so if it is an array or
+  table literal it can't escape the frame, and is built as a temporary.
+*/
+void ThreadingContext::threadTemporary(ASTNode* node, ASTNode* prev_node){
+  if(node->type == ASTNodeType::Array || node->type == ASTNodeType::Table){
+    threadAggregate(node, true);
+  }else{
+    threadAST(node, prev_node);
+  }
+}
+
+namespace {
+  
+  /*
+    A literal is constant if it is a number, string, bool or null, or an array or
+    table literal of constants. The keys of a constant table must be valid keys, so
+    that building it can't fail.
+  */
+  bool isConstant_(ASTNode* node){
+    switch(node->type){
+    case ASTNodeType::Null:
+    case ASTNodeType::Bool:
+    case ASTNodeType::Int:
+    case ASTNodeType::Float:
+    case ASTNodeType::String:
+      return true;
+    case ASTNodeType::Neg:
+      return node->child->type == ASTNodeType::Int
+        || node->child->type == ASTNodeType::Float;
+    case ASTNodeType::Array:
+      for(auto it = node->child->exprListIterator(); it != nullptr; ++it){
+        if(it->type != ASTNodeType::Nop && !isConstant_(it.get())) return false;
+      }
+      return true;
+    case ASTNodeType::Table:
+      for(auto it = node->child->exprListIterator(); it != nullptr; ++it){
+        if(it->type == ASTNodeType::Nop) continue;
+        if(it->type != ASTNodeType::KeyValuePair) return false;
+        auto key = it->children.first;
+        if(key->type != ASTNodeType::String
+        && key->type != ASTNodeType::Int
+        && !(key->type == ASTNodeType::Neg && key->child->type == ASTNodeType::Int)){
+          return false;
+        }
+        if(!isConstant_(it->children.second)) return false;
+      }
+      return true;
+    default:
+      return false;
+    }
+  }
+  
+  TypedValue constantValue_(ASTNode* node){
+    switch(node->type){
+    case ASTNodeType::Null:
+      return TypedValue(nullptr);
+    case ASTNodeType::Bool:
+      return TypedValue(node->bool_value);
+    case ASTNodeType::Int:
+      return TypedValue(node->int_value);
+    case ASTNodeType::Float:
+      return TypedValue(node->float_value);
+    case ASTNodeType::String:
+      return TypedValue(node->string_value);
+    case ASTNodeType::Neg:
+      {
+        TypedValue val = constantValue_(node->child);
+        val.neg();
+        return val;
+      }
+    case ASTNodeType::Array:
+      {
+        TypedValue val = new Array;
+        for(auto it = node->child->exprListIterator(); it != nullptr; ++it){
+          if(it->type == ASTNodeType::Nop) continue;
+          val.value.array_v->push_back(constantValue_(it.get()));
+        }
+        return val;
+      }
+    case ASTNodeType::Table:
+      {
+        TypedValue val = new Table;
+        for(auto it = node->child->exprListIterator(); it != nullptr; ++it){
+          if(it->type == ASTNodeType::Nop) continue;
+          val.value.table_v->insert(
+            constantValue_(it->children.first),
+            constantValue_(it->children.second)
+          );
+        }
+        return val;
+      }
+    default:
+      assert(false);
+      return TypedValue();
+    }
+  }
+}
+
+/*
+  Constant literals are built once, here, and pushed from the constants of the
+  function. Every evaluation of the literal then shares the one object, which is
+  copied on the first write like any other shared array or table.
+  
+  Temporary literals are built in a scratch slot of the frame, see VM::scratch_.
+  Each temporary literal has a slot of its own, since the literals of one
+  expression may be alive at the same time.
+*/
+void ThreadingContext::threadAggregate(ASTNode* node, bool temporary){
+  bool is_array = node->type == ASTNodeType::Array;
+  OpCodes::Type create = is_array? OpCodes::CreateArray : OpCodes::CreateTable;
+  
+  if(node->child->type == ASTNodeType::Nop){
+    D_putInstruction(create);
+    return;
+  }
+  
+  if(isConstant_(node)){
+    D_putInstruction(OpCodes::Push | OpCodes::Extended);
+    D_putInstruction(
+      (OpCodes::Type)(constants.insert(constantValue_(node)) | stack_pos_const)
+    );
+    return;
+  }
+  
+  OpCodes::Type elems = 0;
+  for(auto it = node->child->exprListIterator(); it != nullptr; ++it){
+    if(it->type == ASTNodeType::Nop) continue;
+    if(is_array){
+      threadAST(it.get(), node);
+    }else{
+      assert(it->type == ASTNodeType::KeyValuePair);
+      threadAST(it->children.first, node);
+      threadAST(it->children.second, node);
+    }
+    ++elems;
+  }
+  
+  // the operands are not tagged as stack positions, so they must stay below the tags
+  if(temporary && elems < stack_pos_capture && scratch < stack_pos_capture){
+    D_putInstruction(create | OpCodes::Extended | OpCodes::Extended2 | OpCodes::Alt1);
+    D_putInstruction(elems);
+    D_putInstruction(static_cast<OpCodes::Type>(scratch++));
+  }else{
+    D_putInstruction(create | OpCodes::Extended | OpCodes::Int);
+    D_putInstruction(elems);
+  }
+}
+
+/*
+  A chain of applies, f a b c, is split into runs applied by one instruction each,
+  see OpCodes::Apply in the VM. Every argument of a run but the first is evaluated
+  before the run is applied, where the single applies would interleave them with
+  the calls, so they must be values that can't have effects.
+*/
+void ThreadingContext::threadApply(ASTNode* node){
+  std::vector<ASTNode*> args;
+  ASTNode* callee = node;
+  for(; callee->type == ASTNodeType::Apply; callee = callee->children.first){
+    args.push_back(callee->children.second);
+  }
+  std::reverse(args.begin(), args.end());
+  
+  auto pure = [](ASTNode* arg){
+    return static_cast<ASTNodeType>(static_cast<unsigned>(arg->type) & ~0xff)
+      == ASTNodeType::Value || isConstant_(arg);
+  };
+  
+  threadAST(callee, node);
+  for(size_t first = 0, last; first < args.size(); first = last){
+    threadAST(args[first], node);
+    // the operands are not tagged as stack positions, so they must stay below the tags
+    for(
+      last = first + 1;
+      last < args.size() && last - first < stack_pos_capture && pure(args[last]);
+      ++last
+    ){
+      threadAST(args[last], node);
+    }
+    
+    OpCodes::Type run = last - first;
+    if(run == 1){
+      D_putInstruction(OpCodes::Apply);
+      continue;
+    }
+    
+    D_putInstruction(OpCodes::Apply | OpCodes::Extended | OpCodes::Extended2 | OpCodes::Alt1);
+    D_putInstruction(run);
+    unsigned done_addr = code.size();
+    D_putInstruction((OpCodes::Type)0);
+    D_putInstruction(OpCodes::Apply);
+    for(size_t i = 1; i < run; ++i){
+      D_putInstruction(OpCodes::Swap);
+      D_putInstruction(OpCodes::Apply);
+    }
+    code[done_addr] = (OpCodes::Type)code.size();
+  }
+}
+
 void ThreadingContext::threadRexpr(ASTNode* node, ASTNode* prev_node){
   switch(node->type){
   case ASTNodeType::Identifier:
@@ -684,6 +1132,7 @@ void ThreadingContext::threadRexpr(ASTNode* node, ASTNode* prev_node){
         node->string_value->str()
       );
     }else{
+      assert((it->second & stack_pos_bits) != stack_pos_capture);
       D_putInstruction(OpCodes::Borrow | OpCodes::Extended);
       D_putInstruction(it->second);
     }
@@ -711,6 +1160,145 @@ void ThreadingContext::threadInsRexpr(ASTNode* node, ASTNode* prev_node){
   }
 }
 
+/*
+  Threads the arguments of a call, which must be put right after. The arguments
+  that are variables are added to lent.
+*/
+OpCodes::Type ThreadingContext::threadArguments(ASTNode* args, ASTNode* prev_node){
+  std::vector<unsigned> pushes;
+  OpCodes::Type elems = 0;
+  for(auto it = args->exprListIterator(); it != nullptr; ++it){
+    if(it->type == ASTNodeType::Nop) continue;
+    unsigned at = code.size();
+    threadAST(it.get(), prev_node);
+    if(it->type == ASTNodeType::Identifier
+    && code.size() == at + 2 && code[at] == (OpCodes::Push | OpCodes::Extended)){
+      pushes.push_back(at);
+    }
+    ++elems;
+  }
+  for(auto at: pushes) lent.emplace_back(at, code.size());
+  return elems;
+}
+
+/*
+  Returns the function the callee is known to hold, if calls to it may be
+  inlined. That is a variable declared with a function literal and never
+  assigned, of this function or captured from the enclosing one.
+*/
+const Function* ThreadingContext::inlinableCallee(ASTNode* callee){
+  if(callee->type != ASTNodeType::Identifier) return nullptr;
+  auto find = [](
+    const std::vector<std::pair<OpCodes::Type, const Function*>>& funcs,
+    OpCodes::Type pos
+  ) -> const Function* {
+    for(auto& entry: funcs){
+      if(entry.first == pos) return entry.second;
+    }
+    return nullptr;
+  };
+  
+  auto it = var_allocs->find(callee->string_value);
+  if(it != var_allocs->end() && (it->second & stack_pos_bits) != stack_pos_capture){
+    return find(inlinable, it->second);
+  }
+  if(context_var_allocs != nullptr && context_inlinable != nullptr){
+    auto cit = context_var_allocs->find(callee->string_value);
+    if(cit != context_var_allocs->end()) return find(*context_inlinable, cit->second);
+  }
+  return nullptr;
+}
+
+/*
+  Threads the call node to func by evaluating the arguments into fresh locals
+  and splicing in the code of func, with its arguments, constants and locals
+  moved to this function. The moves and loans of func are left for the passes
+  over this function to find again.
+  All inlined calls share one range of locals, which is grown as needed. The
+  locals of a call are dead once its code ends, and those of the calls in its
+  arguments are dead before its arguments are written.
+*/
+void ThreadingContext::threadInline(ASTNode* node, const Function* func){
+  const unsigned size = func->arguments + func->locals;
+  if(inline_size < size){
+    if(inline_base + inline_size != locals) inline_base = locals;
+    locals = inline_base + size;
+    inline_size = size;
+  }
+  const unsigned base = inline_base;
+  
+  for(auto it = node->children.second->exprListIterator(); it != nullptr; ++it){
+    if(it->type == ASTNodeType::Nop) continue;
+    threadAST(it.get(), node);
+  }
+  for(unsigned i = func->arguments; i-- > 0;){
+    D_putInstruction(OpCodes::Write | OpCodes::Extended);
+    D_putInstruction((base + i) | stack_pos_local);
+  }
+  
+  const auto& body = func->getVCode();
+  const unsigned offset = code.size();
+  const unsigned const_pos = func->arguments;
+  const unsigned local_pos = const_pos + func->getNumValues();
+  auto remap = [&](OpCodes::Type pos) -> OpCodes::Type {
+    if(pos < const_pos) return (base + pos) | stack_pos_local;
+    if(pos < local_pos){
+      return constants.insert(func->getValues()[pos - const_pos]) | stack_pos_const;
+    }
+    return (base + func->arguments + pos - local_pos) | stack_pos_local;
+  };
+  
+  // the spliced code keeps the lines of func, so errors in it point into its body
+  auto position = func->getCodePositions().begin();
+  int line = position->first;
+  auto put = [&](OpCodes::Type ins){this->putInstruction(ins, line);};
+  
+  // the final return is left out, jumps to it land right after the code
+  for(unsigned ip = 0; ip + 1 < body.size(); ip += instructionSize(body[ip])){
+    while(
+      position != func->getCodePositions().end()
+      && position->second <= static_cast<int>(ip)
+    ){
+      line = position->first;
+      ++position;
+    }
+    const OpCodes::Type op = body[ip];
+    switch(op & ~OpCodes::Head){
+    case OpCodes::Push:
+      if((op & (OpCodes::Extended | OpCodes::Int)) == OpCodes::Extended){
+        put(OpCodes::Push | OpCodes::Extended);
+        put(remap(body[ip + 1]));
+        continue;
+      }
+      break;
+    case OpCodes::Write:
+      put(op);
+      put(remap(body[ip + 1]));
+      continue;
+    case OpCodes::Jmp:
+    case OpCodes::Jt:
+    case OpCodes::Jf:
+    case OpCodes::Jtsc:
+    case OpCodes::Jfsc:
+      put(op);
+      put(static_cast<OpCodes::Type>(body[ip + 1] + offset));
+      continue;
+    default:
+      break;
+    }
+    for(unsigned i = 0; i < instructionSize(op); ++i){
+      put(body[ip + i]);
+    }
+  }
+}
+
+void ThreadingContext::borrowVariable(ASTNode* lvalue){
+  while(lvalue->type == ASTNodeType::Index) lvalue = lvalue->children.first;
+  if(lvalue->type != ASTNodeType::Identifier) return;
+  auto it = var_allocs->find(lvalue->string_value);
+  if(it != var_allocs->end()) borrowed.push_back(it->second);
+}
+
 #undef D_putInstruction
 #undef D_breakError
 #undef D_breakErrorVargs
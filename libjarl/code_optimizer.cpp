@@ -0,0 +1,749 @@
+#include "code_optimizer.h"
+
+#include <algorithm>
+#include <map>
+
+using namespace CodeOptimizer;
+
+unsigned CodeOptimizer::instructionSize(OpCodes::Type op){
+  if((op & OpCodes::Extended) == 0) return 1;
+  if(op & OpCodes::Int) return 2;
+  if(op & OpCodes::Extended2) return 3;
+  return 2;
+}
+
+int CodeOptimizer::jumpTarget(const std::vector<OpCodes::Type>& code, unsigned ip){
+  switch(code[ip] & ~OpCodes::Head){
+  case OpCodes::Jmp:
+  case OpCodes::Jt:
+  case OpCodes::Jf:
+  case OpCodes::Jtsc:
+  case OpCodes::Jfsc:
+  case OpCodes::NextOrJmp:
+    return code[ip + 1];
+  case OpCodes::Apply:
+    return (code[ip] & OpCodes::Alt1)? code[ip + 2] : -1;
+  default:
+    return -1;
+  }
+}
+
+FlowGraph::FlowGraph(const std::vector<OpCodes::Type>& code)
+: code(code), index(code.size() + 1, -1){
+  for(unsigned ip = 0; ip < code.size(); ip += instructionSize(code[ip])){
+    index[ip] = starts.size();
+    starts.push_back(ip);
+  }
+  index[code.size()] = starts.size();
+  targets.resize(starts.size() + 1, false);
+  for(unsigned ip: starts){
+    int target = jumpTarget(code, ip);
+    if(target >= 0) targets[index[target]] = true;
+  }
+}
+
+bool FlowGraph::fallsThrough(unsigned n)const{
+  switch(this->code[this->starts[n]] & ~OpCodes::Head){
+  case OpCodes::Return:
+  case OpCodes::Jmp:
+    return false;
+  default:
+    return jumpTarget(this->code, this->starts[n]) < 0;
+  }
+}
+
+DefUse::DefUse(const FlowGraph& graph, unsigned arguments, unsigned locals)
+: graph(graph),
+  arguments(arguments),
+  variables(arguments + locals),
+  reads(graph.size(), -1),
+  assigns(graph.size(), -1),
+  writes(graph.size(), {{-1, -1}})
+{
+  const auto& code = graph.code;
+  for(unsigned n = 0; n < graph.size(); ++n){
+    const unsigned ip = graph.starts[n];
+    const OpCodes::Type op = code[ip];
+    const bool extended = (op & (OpCodes::Extended | OpCodes::Int | OpCodes::Extended2))
+      == OpCodes::Extended;
+    switch(op & ~OpCodes::Head){
+    case OpCodes::Write:
+      if((op & OpCodes::Head) != OpCodes::Extended) break;
+      assigns[n] = writes[n][0] = this->variable(code[ip + 1]);
+      break;
+    case OpCodes::Borrow:
+      if(!extended) break;
+      reads[n] = this->variable(code[ip + 1]);
+      if((op & OpCodes::Head) == OpCodes::Extended) writes[n][0] = reads[n];
+      break;
+    case OpCodes::NextOrJmp:
+      // the key and value slots are the operands of the BeginIter before it
+      writes[n][0] = this->variable(code[ip - 2]);
+      writes[n][1] = this->variable(code[ip - 1]);
+      break;
+    case OpCodes::Add:
+    case OpCodes::Sub:
+    case OpCodes::Mul:
+    case OpCodes::Div:
+    case OpCodes::Mod:
+    case OpCodes::Append:
+      if(op & OpCodes::Dest) writes[n][0] = this->variable(code[ip + 1]);
+      if(extended) reads[n] = this->variable(code[ip + 1]);
+      break;
+    case OpCodes::Push:
+    case OpCodes::In:
+    case OpCodes::Cmp:
+    case OpCodes::Eq:
+    case OpCodes::Neq:
+    case OpCodes::Gt:
+    case OpCodes::Lt:
+    case OpCodes::Geq:
+    case OpCodes::Leq:
+      if(extended) reads[n] = this->variable(code[ip + 1]);
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+int DefUse::variable(OpCodes::Type pos)const{
+  switch(pos & stack_pos_bits){
+  case stack_pos_arg:
+    return pos < this->arguments? pos : -1;
+  case stack_pos_local:
+    return this->arguments + (pos & ~stack_pos_local);
+  default:
+    return -1;
+  }
+}
+
+OpCodes::Type DefUse::position(int var)const{
+  return static_cast<unsigned>(var) < this->arguments?
+    var : (var - this->arguments) | stack_pos_local;
+}
+
+Liveness::Liveness(const DefUse& def_use)
+: def_use(def_use),
+  words((def_use.variables + 63) / 64),
+  live((def_use.graph.size() + 1) * words, 0)
+{
+  const auto& graph = def_use.graph;
+  std::vector<uint64_t> out(words);
+  for(bool changed = true; changed;){
+    changed = false;
+    for(unsigned n = graph.size(); n-- > 0;){
+      this->liveOut(n, out);
+      int var = def_use.assigns[n];
+      if(var >= 0) out[var / 64] &= ~(uint64_t(1) << (var % 64));
+      var = def_use.reads[n];
+      if(var >= 0) out[var / 64] |= uint64_t(1) << (var % 64);
+      
+      for(unsigned w = 0; w < words; ++w){
+        if(live[n * words + w] != out[w]){
+          live[n * words + w] = out[w];
+          changed = true;
+        }
+      }
+    }
+  }
+}
+
+void Liveness::liveOut(unsigned n, std::vector<uint64_t>& out)const{
+  const auto& graph = this->def_use.graph;
+  std::fill(out.begin(), out.end(), 0);
+  graph.successors(n, [&](unsigned succ){
+    for(unsigned w = 0; w < words; ++w) out[w] |= this->live[succ * words + w];
+    // the loop variables are only written when the loop goes on
+    if((graph.code[graph.starts[n]] & ~OpCodes::Head) == OpCodes::NextOrJmp
+    && succ == n + 1){
+      for(int var: this->def_use.writes[n]){
+        if(var >= 0) out[var / 64] &= ~(uint64_t(1) << (var % 64));
+      }
+    }
+  });
+}
+
+void CodeOptimizer::prependCode(TaggedCode& tagged, const std::vector<OpCodes::Type>& entry){
+  auto& code = tagged.code;
+  const unsigned shift = entry.size();
+  for(unsigned ip = 0; ip < code.size(); ip += instructionSize(code[ip])){
+    if(jumpTarget(code, ip) < 0) continue;
+    unsigned operand = (code[ip] & ~OpCodes::Head) == OpCodes::Apply? 2 : 1;
+    code[ip + operand] += shift;
+  }
+  code.insert(code.begin(), entry.begin(), entry.end());
+  
+  for(auto& position: tagged.code_positions){
+    if(position.second > 0) position.second += shift;
+  }
+  for(unsigned& ip: tagged.pinned) ip += shift;
+  for(auto& arg: tagged.lent){
+    arg.first += shift;
+    arg.second += shift;
+  }
+}
+
+namespace {
+  
+  bool pinned_(const TaggedCode& tagged, unsigned ip){
+    return std::find(tagged.pinned.begin(), tagged.pinned.end(), ip) != tagged.pinned.end();
+  }
+  
+  /*
+    Replaces the instructions starting at the keys of edits with the words mapped
+    to them, which may be none. The jumps of the other instructions, the code
+    positions, pinned and lent are moved along, and a jump to a removed
+    instruction lands on whatever follows it. Edited instructions may not jump,
+    and are dropped from pinned and lent. Returns where each old code position
+    ended up.
+  */
+  std::vector<unsigned> rewrite_(
+    TaggedCode& tagged,
+    const std::map<unsigned, std::vector<OpCodes::Type>>& edits
+  ){
+    auto& code = tagged.code;
+    std::vector<unsigned> moved(code.size() + 1);
+    std::vector<OpCodes::Type> result;
+    result.reserve(code.size());
+    
+    for(unsigned ip = 0; ip < code.size(); ip += instructionSize(code[ip])){
+      const unsigned size = instructionSize(code[ip]);
+      auto edit = edits.find(ip);
+      for(unsigned i = 0; i < size; ++i){
+        moved[ip + i] = result.size() + (edit == edits.end()? i : 0);
+      }
+      if(edit == edits.end()){
+        result.insert(result.end(), code.begin() + ip, code.begin() + ip + size);
+      }else{
+        result.insert(result.end(), edit->second.begin(), edit->second.end());
+      }
+    }
+    moved[code.size()] = result.size();
+    
+    for(unsigned ip = 0; ip < code.size(); ip += instructionSize(code[ip])){
+      if(edits.count(ip) != 0) continue;
+      int target = jumpTarget(code, ip);
+      if(target < 0) continue;
+      unsigned operand = (code[ip] & ~OpCodes::Head) == OpCodes::Apply? 2 : 1;
+      result[moved[ip] + operand] = static_cast<OpCodes::Type>(moved[target]);
+    }
+    
+    for(auto& position: tagged.code_positions){
+      position.second = moved[position.second];
+    }
+    std::vector<unsigned> pinned;
+    for(unsigned ip: tagged.pinned){
+      if(edits.count(ip) == 0) pinned.push_back(moved[ip]);
+    }
+    tagged.pinned = std::move(pinned);
+    std::vector<std::pair<unsigned, unsigned>> lent;
+    for(auto& arg: tagged.lent){
+      if(edits.count(arg.first) == 0 && edits.count(arg.second) == 0){
+        lent.emplace_back(moved[arg.first], moved[arg.second]);
+      }
+    }
+    tagged.lent = std::move(lent);
+    
+    code = std::move(result);
+    return moved;
+  }
+  
+  /*
+    The number of values an instruction without effects takes from the stack, it
+    always leaves one. -1 for instructions that may have effects other than
+    failing. These may be evaluated once instead of twice, or earlier, as long as
+    the variables they read keep their values.
+  */
+  int pureArity_(OpCodes::Type op){
+    const OpCodes::Type head = op & OpCodes::Head;
+    switch(op & ~OpCodes::Head){
+    case OpCodes::Push:
+      return head == 0 || head == OpCodes::Extended
+        || head == (OpCodes::Extended | OpCodes::Int)? 0 : -1;
+    case OpCodes::PushTrue:
+    case OpCodes::PushFalse:
+      return head == 0? 0 : -1;
+    case OpCodes::Neg:
+    case OpCodes::Not:
+      return head == 0? 1 : -1;
+    case OpCodes::Add:
+    case OpCodes::Sub:
+    case OpCodes::Mul:
+    case OpCodes::Div:
+    case OpCodes::Mod:
+    case OpCodes::Append:
+    case OpCodes::Cmp:
+    case OpCodes::Eq:
+    case OpCodes::Neq:
+    case OpCodes::Gt:
+    case OpCodes::Lt:
+    case OpCodes::Geq:
+    case OpCodes::Leq:
+    case OpCodes::In:
+    case OpCodes::Get:
+      return head == 0? 2 : -1;
+    case OpCodes::Slice:
+      return head == 0? 3 : -1;
+    default:
+      return -1;
+    }
+  }
+  
+  /*
+    The first instruction of the expression without effects that instruction last
+    ends, at or after first, or -1 if there is none.
+  */
+  int expressionStart_(const FlowGraph& graph, int last, int first){
+    int need = 1;
+    for(int n = last; n >= first; --n){
+      int arity = pureArity_(graph.code[graph.starts[n]]);
+      if(arity < 0) return -1;
+      need += arity - 1;
+      if(need == 0) return n;
+    }
+    return -1;
+  }
+  
+  // the variables read by the instructions from first to last
+  std::vector<int> readVariables_(const DefUse& def_use, unsigned first, unsigned last){
+    std::vector<int> vars;
+    for(unsigned n = first; n <= last; ++n){
+      if(def_use.reads[n] >= 0) vars.push_back(def_use.reads[n]);
+    }
+    return vars;
+  }
+  
+  // true if an instruction from first to last may write one of vars
+  bool writesAny_(
+    const DefUse& def_use,
+    unsigned first,
+    unsigned last,
+    const std::vector<int>& vars
+  ){
+    for(unsigned n = first; n <= last; ++n){
+      for(int var: vars){
+        if(def_use.mayWrite(n, var)) return true;
+      }
+    }
+    return false;
+  }
+  
+  /*
+    The passes below rewrite the code, and run in the order they are defined.
+    Each builds the analyses it needs from the code as the ones before left it.
+  */
+  
+  /*
+    Copy propagation. A variable assigned by pushing a constant, an int or another
+    variable right before writing it holds a copy of that until either is written.
+    Reads of the variable where every path agrees on the copy read the source
+    instead, which often leaves the write dead.
+  */
+  void propagateCopies_(TaggedCode& tagged){
+    auto& code = tagged.code;
+    const unsigned vars = tagged.arguments + tagged.locals;
+    if(vars == 0) return;
+    
+    // what a variable is known to hold, the source is encoded in the low bits
+    constexpr uint32_t unknown   = 0;
+    constexpr uint32_t immediate = 0x10000;
+    constexpr uint32_t position  = 0x20000;
+    constexpr uint32_t unvisited = 0xffffffff;
+    
+    FlowGraph graph(code);
+    DefUse def_use(graph, tagged.arguments, tagged.locals);
+    std::vector<uint32_t> known((graph.size() + 1) * vars, unvisited);
+    std::fill(known.begin(), known.begin() + vars, unknown);
+    
+    std::vector<uint32_t> facts(vars);
+    auto transfer = [&](unsigned n){
+      std::copy(known.begin() + n * vars, known.begin() + (n + 1) * vars, facts.begin());
+      for(int var: def_use.writes[n]){
+        if(var < 0) continue;
+        facts[var] = unknown;
+        uint32_t copy = position | def_use.position(var);
+        std::replace(facts.begin(), facts.end(), copy, unknown);
+      }
+      int var = def_use.assigns[n];
+      if(var >= 0 && n > 0 && !graph.targets[n]){
+        unsigned push = graph.starts[n - 1];
+        uint32_t source = unknown;
+        if(code[push] == (OpCodes::Push | OpCodes::Extended | OpCodes::Int)){
+          source = immediate | code[push + 1];
+        }else if(
+          code[push] == (OpCodes::Push | OpCodes::Extended)
+          && def_use.reads[n - 1] != var
+        ){
+          source = position | code[push + 1];
+        }
+        facts[var] = source;
+      }
+    };
+    
+    for(bool changed = true; changed;){
+      changed = false;
+      for(unsigned n = 0; n < graph.size(); ++n){
+        if(known[n * vars] == unvisited) continue;
+        transfer(n);
+        graph.successors(n, [&](unsigned succ){
+          for(unsigned v = 0; v < vars; ++v){
+            uint32_t& fact = known[succ * vars + v];
+            uint32_t merged = fact == unvisited || fact == facts[v]? facts[v] : unknown;
+            if(fact != merged){
+              fact = merged;
+              changed = true;
+            }
+          }
+        });
+      }
+    }
+    
+    for(unsigned n = 0; n < graph.size(); ++n){
+      unsigned ip = graph.starts[n];
+      if(code[ip] != (OpCodes::Push | OpCodes::Extended) || pinned_(tagged, ip)) continue;
+      int var = def_use.reads[n];
+      if(var < 0 || known[n * vars] == unvisited) continue;
+      uint32_t fact = known[n * vars + var];
+      if(fact == unknown) continue;
+      // the source may itself be a copy here
+      for(unsigned step = 0; step < vars && (fact & position); ++step){
+        int source = def_use.variable(static_cast<OpCodes::Type>(fact & 0xffff));
+        if(source < 0 || known[n * vars + source] == unknown) break;
+        fact = known[n * vars + source];
+      }
+      if(fact & immediate){
+        code[ip] = OpCodes::Push | OpCodes::Extended | OpCodes::Int;
+      }
+      code[ip + 1] = static_cast<OpCodes::Type>(fact & 0xffff);
+    }
+  }
+  
+  /*
+    Common subexpression elimination. An expression without effects that is
+    computed again further down the same straight run of code, with the variables
+    it reads unchanged, is kept in a new local the first time and read from it
+    after that.
+  */
+  void eliminateCommonSubexpressions_(TaggedCode& tagged){
+    auto& code = tagged.code;
+    FlowGraph graph(code);
+    DefUse def_use(graph, tagged.arguments, tagged.locals);
+    std::map<unsigned, std::vector<OpCodes::Type>> edits;
+    std::vector<bool> used(graph.size(), false);
+    
+    // the expressions worth keeping, which take more than a push to compute
+    struct Expression{
+      unsigned first, last;
+    };
+    auto same = [&](const Expression& a, const Expression& b){
+      unsigned begin = graph.starts[a.first];
+      unsigned end = graph.starts[a.last] + instructionSize(code[graph.starts[a.last]]);
+      unsigned other = graph.starts[b.first];
+      unsigned other_end =
+        graph.starts[b.last] + instructionSize(code[graph.starts[b.last]]);
+      return end - begin == other_end - other
+        && std::equal(code.begin() + begin, code.begin() + end, code.begin() + other);
+    };
+    
+    for(unsigned block = 0; block < graph.size();){
+      unsigned end = block + 1;
+      while(end < graph.size() && !graph.targets[end] && graph.fallsThrough(end - 1)){
+        ++end;
+      }
+      
+      std::vector<Expression> exprs;
+      for(unsigned n = block; n < end; ++n){
+        int first = expressionStart_(graph, n, block);
+        if(first >= 0 && n - first >= 2) exprs.push_back({unsigned(first), n});
+      }
+      // the largest first, each against the ones after it
+      std::stable_sort(exprs.begin(), exprs.end(), [](const Expression& a, const Expression& b){
+        return a.last - a.first > b.last - b.first;
+      });
+      
+      for(unsigned i = 0; i < exprs.size(); ++i){
+        const Expression& expr = exprs[i];
+        if(std::find(used.begin() + expr.first, used.begin() + expr.last + 1, true)
+          != used.begin() + expr.last + 1) continue;
+        auto reads = readVariables_(def_use, expr.first, expr.last);
+        
+        std::vector<Expression> repeats;
+        for(unsigned j = 0; j < exprs.size(); ++j){
+          const Expression& repeat = exprs[j];
+          if(repeat.first <= expr.last || !same(expr, repeat)) continue;
+          if(std::find(used.begin() + repeat.first, used.begin() + repeat.last + 1, true)
+            != used.begin() + repeat.last + 1) continue;
+          if(writesAny_(def_use, expr.first, repeat.last, reads)) continue;
+          bool overlaps = false;
+          for(auto& other: repeats){
+            overlaps |= repeat.first <= other.last && other.first <= repeat.last;
+          }
+          if(!overlaps) repeats.push_back(repeat);
+        }
+        if(repeats.empty() || tagged.locals >= stack_pos_capture) continue;
+        
+        const OpCodes::Type local = (tagged.locals++) | stack_pos_local;
+        unsigned ip = graph.starts[expr.last];
+        std::vector<OpCodes::Type> kept(code.begin() + ip, code.begin() + ip + instructionSize(code[ip]));
+        kept.insert(kept.end(), {
+          OpCodes::Write | OpCodes::Extended, local,
+          OpCodes::Push | OpCodes::Extended, local
+        });
+        edits[ip] = std::move(kept);
+        std::fill(used.begin() + expr.first, used.begin() + expr.last + 1, true);
+        for(auto& repeat: repeats){
+          edits[graph.starts[repeat.first]] = {OpCodes::Push | OpCodes::Extended, local};
+          for(unsigned n = repeat.first + 1; n <= repeat.last; ++n){
+            edits[graph.starts[n]] = {};
+          }
+          std::fill(used.begin() + repeat.first, used.begin() + repeat.last + 1, true);
+        }
+      }
+      block = end;
+    }
+    
+    if(!edits.empty()) rewrite_(tagged, edits);
+  }
+  
+  /*
+    Loop invariant code motion. The condition of a while loop is evaluated at least
+    once, so an expression in it that reads no variable the loop writes is
+    computed once into a new local before the loop. Only pushes may come before
+    the expression in the condition, so any failure in it happens at the same
+    point as before.
+  */
+  void hoistLoopInvariants_(TaggedCode& tagged){
+    auto& code = tagged.code;
+    FlowGraph graph(code);
+    DefUse def_use(graph, tagged.arguments, tagged.locals);
+    std::map<unsigned, std::vector<OpCodes::Type>> edits;
+    // the back edges to point past the hoisted code, with where it goes
+    std::vector<std::pair<unsigned, unsigned>> back_edges;
+    std::vector<unsigned> hoisted_sizes;
+    
+    for(unsigned n = 0; n < graph.size(); ++n){
+      unsigned ip = graph.starts[n];
+      if(code[ip] != (OpCodes::Jmp | OpCodes::Extended) || code[ip + 1] >= ip) continue;
+      unsigned begin = code[ip + 1];
+      unsigned head = graph.index[begin];
+      if(edits.count(begin) != 0) continue;
+      
+      // the condition ends in the jump out of the loop
+      unsigned exit = head;
+      while(exit < n && pureArity_(code[graph.starts[exit]]) >= 0) ++exit;
+      if(
+        exit == n
+        || code[graph.starts[exit]] != (OpCodes::Jf | OpCodes::Extended)
+        || code[graph.starts[exit] + 1] != ip + 2
+      ) continue;
+      
+      int best_first = -1, best_last = -1;
+      for(unsigned last = head; last < exit; ++last){
+        int first = expressionStart_(graph, last, head);
+        if(first < 0 || last == unsigned(first)) continue;
+        bool pushes_only = true;
+        for(unsigned k = head; k < unsigned(first); ++k){
+          pushes_only &= pureArity_(code[graph.starts[k]]) == 0;
+        }
+        if(!pushes_only) continue;
+        auto reads = readVariables_(def_use, first, last);
+        if(writesAny_(def_use, head, n, reads)) continue;
+        if(best_first < 0 || int(last) - first > best_last - best_first){
+          best_first = first;
+          best_last = last;
+        }
+      }
+      if(best_first < 0 || tagged.locals >= stack_pos_capture) continue;
+      
+      const OpCodes::Type local = (tagged.locals++) | stack_pos_local;
+      unsigned expr_begin = graph.starts[best_first];
+      unsigned expr_end = graph.starts[best_last] + instructionSize(code[graph.starts[best_last]]);
+      std::vector<OpCodes::Type> hoisted(code.begin() + expr_begin, code.begin() + expr_end);
+      hoisted.insert(hoisted.end(), {OpCodes::Write | OpCodes::Extended, local});
+      const unsigned hoisted_size = hoisted.size();
+      
+      for(unsigned k = best_first + 1; k <= unsigned(best_last); ++k){
+        edits[graph.starts[k]] = {};
+      }
+      if(unsigned(best_first) == head){
+        hoisted.insert(hoisted.end(), {OpCodes::Push | OpCodes::Extended, local});
+      }else{
+        edits[expr_begin] = {OpCodes::Push | OpCodes::Extended, local};
+        hoisted.insert(
+          hoisted.end(),
+          code.begin() + begin,
+          code.begin() + begin + instructionSize(code[begin])
+        );
+      }
+      edits[begin] = std::move(hoisted);
+      back_edges.emplace_back(ip, begin);
+      hoisted_sizes.push_back(hoisted_size);
+    }
+    
+    if(edits.empty()) return;
+    auto moved = rewrite_(tagged, edits);
+    for(unsigned i = 0; i < back_edges.size(); ++i){
+      code[moved[back_edges[i].first] + 1] =
+        static_cast<OpCodes::Type>(moved[back_edges[i].second] + hoisted_sizes[i]);
+    }
+  }
+  
+  /*
+    Dead code elimination. A write to a variable that is not live after it is
+    dropped, along with the push of its value if that has no effects. So is a
+    push that is popped right away.
+  */
+  void removeDeadCode_(TaggedCode& tagged){
+    auto& code = tagged.code;
+    if(tagged.arguments + tagged.locals == 0) return;
+    
+    FlowGraph graph(code);
+    DefUse def_use(graph, tagged.arguments, tagged.locals);
+    Liveness liveness(def_use);
+    std::vector<uint64_t> out(liveness.words);
+    std::map<unsigned, std::vector<OpCodes::Type>> edits;
+    
+    for(unsigned n = 0; n < graph.size(); ++n){
+      unsigned ip = graph.starts[n];
+      bool dead;
+      if(code[ip] == (OpCodes::Write | OpCodes::Extended)){
+        int var = def_use.assigns[n];
+        if(var < 0) continue;
+        liveness.liveOut(n, out);
+        dead = (out[var / 64] & (uint64_t(1) << (var % 64))) == 0;
+      }else{
+        dead = code[ip] == OpCodes::Pop;
+      }
+      if(!dead) continue;
+      
+      unsigned push = n > 0? graph.starts[n - 1] : 0;
+      if(
+        n > 0 && !graph.targets[n] && edits.count(push) == 0
+        && pureArity_(code[push]) == 0 && !pinned_(tagged, push)
+      ){
+        edits[push] = {};
+        edits[ip] = {};
+      }else if(code[ip] != OpCodes::Pop){
+        edits[ip] = {OpCodes::Pop};
+      }
+    }
+    
+    if(!edits.empty()) rewrite_(tagged, edits);
+  }
+  
+  /*
+    The passes below only mark instructions, so they share the analyses of the
+    code the passes above leave.
+  */
+  
+  /*
+    Turns the last read of each argument and local into a move, see the note in
+    function.h. A push of a variable that is not live after it is its last read.
+  */
+  void markLastReads_(TaggedCode& tagged, const DefUse& def_use){
+    if(def_use.variables == 0) return;
+    
+    auto& code = tagged.code;
+    const auto& graph = def_use.graph;
+    Liveness liveness(def_use);
+    std::vector<uint64_t> out(liveness.words);
+    
+    for(unsigned n = 0; n < graph.size(); ++n){
+      unsigned ip = graph.starts[n];
+      if((code[ip] & ~OpCodes::Head) != OpCodes::Push) continue;
+      int var = def_use.reads[n];
+      if(var < 0 || pinned_(tagged, ip)) continue;
+      liveness.liveOut(n, out);
+      if((out[var / 64] & (uint64_t(1) << (var % 64))) == 0){
+        code[ip] |= OpCodes::Alt1;
+      }
+    }
+  }
+  
+  /*
+    Marks the pushes of call arguments that may lend the variable to the callee
+    instead of copying it. The variable must keep its value until the call, so it
+    may not be written or moved from by the code evaluating the rest of the
+    arguments. A push that moves only lends when the variable is itself borrowed,
+    and can't be moved.
+  */
+  void markLentArguments_(TaggedCode& tagged, const DefUse& def_use){
+    auto& code = tagged.code;
+    const auto& graph = def_use.graph;
+    for(auto& arg: tagged.lent){
+      // the push may already move, and copy propagation may have made it a push of an int
+      if((code[arg.first] & ~OpCodes::Alt1) != (OpCodes::Push | OpCodes::Extended)) continue;
+      const OpCodes::Type pos = code[arg.first + 1];
+      const int var = def_use.variable(pos);
+      bool lend = true;
+      for(
+        unsigned n = graph.index[arg.first] + 1;
+        n < graph.size() && graph.starts[n] < arg.second && lend;
+        ++n
+      ){
+        unsigned ip = graph.starts[n];
+        lend = !def_use.mayWrite(n, var) && !(
+          (code[ip] & ~OpCodes::Head) == OpCodes::Push
+          && (code[ip] & OpCodes::Alt1) && code[ip + 1] == pos
+        );
+      }
+      if(lend) code[arg.first] |= OpCodes::Alt2;
+    }
+  }
+  
+  // the arguments that are never written to, see Function::borrowable
+  uint64_t borrowableArguments_(const DefUse& def_use){
+    uint64_t borrowable = def_use.arguments >= 64?
+      ~uint64_t(0) : (uint64_t(1) << def_use.arguments) - 1;
+    for(auto& written: def_use.writes){
+      for(int var: written){
+        if(var >= 0 && var < 64) borrowable &= ~(uint64_t(1) << var);
+      }
+    }
+    return borrowable;
+  }
+  
+  /*
+    Renumbers the locals so that those no longer in the code, like the ones left
+    by inlined calls once their copies are propagated, take no room in the frame.
+  */
+  void compactLocals_(TaggedCode& tagged){
+    auto& code = tagged.code;
+    std::vector<OpCodes::Type> renumbered(tagged.locals, 0);
+    auto operands = [&](auto f){
+      for(unsigned ip = 0; ip < code.size(); ip += instructionSize(code[ip])){
+        if((code[ip] & OpCodes::Extended) == 0 || (code[ip] & OpCodes::Int)) continue;
+        for(unsigned i = 1; i < instructionSize(code[ip]); ++i){
+          if((code[ip + i] & stack_pos_bits) == stack_pos_local) f(code[ip + i]);
+        }
+      }
+    };
+    operands([&](OpCodes::Type& pos){ renumbered[pos & ~stack_pos_local] = 1; });
+    unsigned used = 0;
+    for(auto& local: renumbered){
+      if(local) local = (used++) | stack_pos_local;
+    }
+    if(used == tagged.locals) return;
+    operands([&](OpCodes::Type& pos){ pos = renumbered[pos & ~stack_pos_local]; });
+    tagged.locals = used;
+  }
+}
+
+uint64_t CodeOptimizer::optimize(TaggedCode& tagged){
+  propagateCopies_(tagged);
+  eliminateCommonSubexpressions_(tagged);
+  hoistLoopInvariants_(tagged);
+  removeDeadCode_(tagged);
+  
+  uint64_t borrowable;
+  {
+    FlowGraph graph(tagged.code);
+    DefUse def_use(graph, tagged.arguments, tagged.locals);
+    markLastReads_(tagged, def_use);
+    markLentArguments_(tagged, def_use);
+    borrowable = borrowableArguments_(def_use);
+  }
+  compactLocals_(tagged);
+  return borrowable;
+}
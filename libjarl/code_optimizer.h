@@ -0,0 +1,151 @@
+#ifndef CODE_OPTIMIZER_H_INCLUDED
+#define CODE_OPTIMIZER_H_INCLUDED
+
+#include "op_codes.h"
+
+#include <vector>
+#include <array>
+#include <utility>
+#include <cstdint>
+
+/*
+  The passes the code generator runs over the code of a function once it is
+  threaded, and the analyses they share.
+  
+  They run before the stack positions are corrected, while the operands that are
+  stack positions are still tagged with what they refer to. Arguments and locals
+  are numbered as variables, arguments first, so that the analyses can keep one
+  bit or slot per variable.
+*/
+
+constexpr OpCodes::Type stack_pos_bits     = 0xe000;
+constexpr OpCodes::Type stack_pos_arg      = 0x0000;
+constexpr OpCodes::Type stack_pos_local    = 0x8000;
+constexpr OpCodes::Type stack_pos_const    = 0x4000;
+constexpr OpCodes::Type stack_pos_capture  = 0x2000;
+
+namespace CodeOptimizer {
+  
+  unsigned instructionSize(OpCodes::Type op);
+  
+  // the code position jumped to by the instruction at ip, or -1 if it doesn't jump
+  int jumpTarget(const std::vector<OpCodes::Type>& code, unsigned ip);
+  
+  /*
+    The code of a function with stack positions still tagged, and what the passes
+    need to know about it. The passes keep all of it up to date.
+  */
+  struct TaggedCode {
+    std::vector<OpCodes::Type> code;
+    std::vector<std::pair<int, int>> code_positions;
+    
+    unsigned arguments, locals;
+    
+    // pushes of borrowed variables, which may not be turned into moves
+    std::vector<unsigned> pinned;
+    // pushes of variables passed as arguments, each with its call
+    std::vector<std::pair<unsigned, unsigned>> lent;
+    
+    TaggedCode(unsigned args, unsigned locs): arguments(args), locals(locs){}
+  };
+  
+  /*
+    The instructions of a function's code and the paths between them. Instructions
+    are numbered in order, the number past the last one stands for the end.
+  */
+  struct FlowGraph {
+    const std::vector<OpCodes::Type>& code;
+    // the start of each instruction
+    std::vector<unsigned> starts;
+    // the instruction starting at each code position, or -1
+    std::vector<int> index;
+    // the instructions that are jumped to
+    std::vector<bool> targets;
+    
+    FlowGraph(const std::vector<OpCodes::Type>& code);
+    
+    size_t size()const{
+      return this->starts.size();
+    }
+    
+    // calls f with each instruction that may run after instruction n
+    template<class F>
+    void successors(unsigned n, F f)const{
+      unsigned ip = this->starts[n];
+      switch(this->code[ip] & ~OpCodes::Head){
+      case OpCodes::Return:
+        break;
+      case OpCodes::Jmp:
+        f(this->index[this->code[ip + 1]]);
+        break;
+      default:
+        f(n + 1);
+        int target = jumpTarget(this->code, ip);
+        if(target >= 0) f(this->index[target]);
+        break;
+      }
+    }
+    
+    // true if control only leaves instruction n for the next one
+    bool fallsThrough(unsigned n)const;
+  };
+  
+  /*
+    The variables each instruction of a flow graph reads and writes. An
+    instruction reads at most one variable and may write two, the loop variables
+    of a NextOrJmp. Only a plain write replaces the value of the variable, the
+    others may keep part of it.
+  */
+  struct DefUse {
+    const FlowGraph& graph;
+    const unsigned arguments;
+    const unsigned variables;
+    // the variable read by each instruction, or -1
+    std::vector<int> reads;
+    // the variable whose value each instruction replaces, or -1
+    std::vector<int> assigns;
+    // the variables each instruction may write, -1 for none
+    std::vector<std::array<int, 2>> writes;
+    
+    DefUse(const FlowGraph& graph, unsigned arguments, unsigned locals);
+    
+    // the variable at a tagged stack position, or -1 if it is not an argument or local
+    int variable(OpCodes::Type pos)const;
+    // the tagged stack position of a variable
+    OpCodes::Type position(int var)const;
+    
+    bool mayWrite(unsigned n, int var)const{
+      return var >= 0 && (this->writes[n][0] == var || this->writes[n][1] == var);
+    }
+  };
+  
+  /*
+    The variables live after each instruction. A variable is live after an
+    instruction if some path from there reads it before assigning it.
+  */
+  struct Liveness {
+    const DefUse& def_use;
+    const unsigned words;
+    // the variables live before each instruction, one bit per variable
+    std::vector<uint64_t> live;
+    
+    Liveness(const DefUse& def_use);
+    
+    void liveOut(unsigned n, std::vector<uint64_t>& out)const;
+  };
+  
+  /*
+    Puts code in front of the function's code. Jumps to the start still go to
+    the code that was there.
+  */
+  void prependCode(TaggedCode&, const std::vector<OpCodes::Type>& entry);
+  
+  /*
+    Runs the passes over the code, ending with the last reads and lent arguments
+    marked and the locals that are left renumbered. Returns the arguments that
+    are never written, see Function::borrowable.
+  */
+  uint64_t optimize(TaggedCode&);
+}
+
+#endif
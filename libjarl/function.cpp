@@ -4,6 +4,7 @@
 #include "delegate_map.h"
 
 #include <limits>
+#include <cstring>
 #include <cassert>
 
 namespace std{
@@ -19,18 +20,38 @@ Function::Function(
   std::vector<std::pair<int, int>>&& code_positions,
   unsigned arguments,
   unsigned captures,
-  unsigned locals
+  unsigned locals,
+  unsigned scratch,
+  uint64_t borrowable
 ):
   code_(std::move(code)),
   values_(std::move(values)),
   code_positions_(std::move(code_positions)),
   arguments(arguments),
   captures(captures),
-  locals(locals)
+  locals(locals),
+  scratch(scratch),
+  borrowable(borrowable)
 {}
 
-PartiallyApplied::PartiallyApplied(const Function* func)
-: func_(func), args_(func->arguments + func->captures), nargs(func->arguments){}
+Environment::Environment(TypedValue* from, TypedValue* to)
+: values_(std::make_move_iterator(from), std::make_move_iterator(to)){}
+
+Environment::~Environment(){}
+
+/*
+  Returns true if the environment holds exactly the values of the same number
+  starting at values, so that a closure over them may share it. Values are compared
+  bitwise, objects are the same only if they are the same object.
+*/
+bool Environment::holds(const TypedValue* values)const{
+  return memcmp(
+    this->values_.data(), values, this->values_.size() * sizeof(TypedValue)
+  ) == 0;
+}
+
+PartiallyApplied::PartiallyApplied(const Function* func, Environment* env)
+: func_(func), env_(env), args_(func->arguments), nargs(func->arguments){}
 
 void PartiallyApplied::apply(const TypedValue& val, int bind_pos){
   assert(this->nargs > 0);
@@ -56,13 +77,6 @@ void PartiallyApplied::apply(TypedValue&& val, int bind_pos){
   }
   --this->nargs;
 }
-void PartiallyApplied::capture(TypedValue* from, TypedValue* to){
-  assert((to - from) == this->func_->captures);
-  for(int bind_pos = this->func_->arguments; from != to; ++from, ++bind_pos){
-    this->args_[bind_pos] = std::move(*from);
-  }
-}
-
 int Function::getLine(const OpCodes::Type* iit) const {
   ptrdiff_t pos = iit - this->code_.data();
   auto it = this->code_positions_.begin();
@@ -115,6 +129,10 @@ std::string Function::toStrDebug()const{
 }
 
 std::string PartiallyApplied::toStrDebug()const{
+  if(this->args_.size() == 0){
+    std::unique_ptr<char[]> buffer(dynSprintf("function %p ()", this->getFunc()));
+    return buffer.get();
+  }
   auto it = this->args_.begin();
   std::unique_ptr<char[]> buffer(dynSprintf("%s", it->toStrDebug().c_str()));
   for(++it; it != this->args_.end(); ++it){
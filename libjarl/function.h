@@ -2,6 +2,7 @@
 #define PROCEDURE_H_INCLUDED
 
 #include "rc_mixin.h"
+#include "object_pools.h"
 #include "value.h"
 #include "ast.h"
 #include "vector_map.h"
@@ -22,6 +23,9 @@
 /*
   Note:
     op_push with op_dest flag pushes an integer stored in the code
+    op_push with op_alt1 flag moves the variable, it is the last read of it
+    op_push with op_alt2 flag lends the variable to the function called with it,
+      see VM::takeArguments_
 */
 
 class TypedValue;
@@ -35,6 +39,13 @@ class Function: public RcDirectMixin<Function>{
 public:
   
   unsigned arguments, captures, locals;
+  // number of scratch slots used by the temporary literals of the function
+  unsigned scratch;
+  /*
+    The arguments the function never writes to, one bit each for the first 64.
+    A caller may lend these instead of copying them, see VM::takeArguments_.
+  */
+  uint64_t borrowable;
   
   Function(const Function&) = delete;
   Function(Function&&) = delete;
@@ -45,7 +56,9 @@ public:
     std::vector<std::pair<int, int>>&& code_positions,
     unsigned arguments,
     unsigned captures,
-    unsigned locals
+    unsigned locals,
+    unsigned scratch,
+    uint64_t borrowable
   );
   
   const std::vector<OpCodes::Type>& getVCode()const{return this->code_;}
@@ -57,9 +70,15 @@ public:
   size_t getNumValues()const{return this->values_.size();}
   
   int getLine(const OpCodes::Type*) const;
+  const std::vector<std::pair<int, int>>& getCodePositions()const{
+    return this->code_positions_;
+  }
   
+  static void* operator new(size_t size){
+    return ObjectPools::allocate(size);
+  }
   void operator delete(void* ptr){
-    ::operator delete(ptr);
+    ObjectPools::deallocate(ptr);
   }
   
   #ifndef NDEBUG
@@ -68,24 +87,54 @@ public:
   #endif
 };
 
+/*
+  The values captured by a closure. Closures and the frames they are called in
+  share the environment, instead of each holding a copy of the captures.
+*/
+class Environment: public RcDirectMixin<Environment>{
+  
+  std::vector<TypedValue> values_;
+  
+public:
+  
+  Environment(TypedValue*, TypedValue*);
+  ~Environment();
+  
+  const TypedValue& operator[](unsigned i)const{return this->values_[i];}
+  bool holds(const TypedValue*)const;
+  
+  static void* operator new(size_t size){
+    return ObjectPools::allocate(size);
+  }
+  void operator delete(void* ptr){
+    ObjectPools::deallocate(ptr);
+  }
+};
+
 class PartiallyApplied: public RcDirectMixin<PartiallyApplied>{
   
+  // TypedValue is incomplete here, see the static_assert in value.h
+  #ifdef NAN_BOXED_VALUES
+  typedef SSOVector<TypedValue, 8, sizeof(void*)> ArgVectorType;
+  #else
   typedef SSOVector<TypedValue, 8, sizeof(void*) * 2> ArgVectorType;
+  #endif
   
   rc_ptr<const Function> func_;
+  rc_ptr<Environment> env_;
   ArgVectorType args_;
   
 public:
 
   int nargs;
   
-  PartiallyApplied(const Function*);
+  PartiallyApplied(const Function*, Environment* = nullptr);
   
   void apply(const TypedValue&, int);
   void apply(TypedValue&&, int);
-  void capture(TypedValue*, TypedValue*);
   
   const Function* getFunc()const{return this->func_.get();}
+  Environment* getEnv()const{return this->env_.get();}
   const ArgVectorType& getArgs()const{return this->args_;}
   
   ArgVectorType::iterator begin(){return this->args_.begin();}
@@ -93,8 +142,11 @@ public:
   ArgVectorType::const_iterator cbegin()const{return this->args_.cbegin();}
   ArgVectorType::const_iterator cend()const{return this->args_.cend();}
   
+  static void* operator new(size_t size){
+    return ObjectPools::allocate(size);
+  }
   void operator delete(void* ptr){
-    ::operator delete(ptr);
+    ObjectPools::deallocate(ptr);
   }
   
   #ifndef NDEBUG
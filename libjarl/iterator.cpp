@@ -5,14 +5,12 @@ Iterator::Iterator(const TypedValue& src){
   case TypeTag::Array:
     this->data_.array_v.ref = src.value.array_v;
     src.value.array_v->incRefCount();
-    this->data_.array_v.current_it = src.value.array_v->begin();
-    this->data_.array_v.end_it = src.value.array_v->end();
+    this->data_.array_v.index = 0;
     break;
   case TypeTag::Table:
     this->data_.table_v.ref = src.value.table_v;
     src.value.table_v->incRefCount();
     this->data_.table_v.current_it = src.value.table_v->begin();
-    this->data_.table_v.end_it = src.value.table_v->end();
     break;
   default:
     assert(false);
@@ -36,9 +34,9 @@ Iterator::~Iterator(){
 bool Iterator::ended()const{
   switch(this->type_){
   case TypeTag::Array:
-    return this->data_.array_v.current_it == this->data_.array_v.end_it;
+    return this->data_.array_v.index == this->data_.array_v.ref->size();
   case TypeTag::Table:
-    return this->data_.table_v.current_it == this->data_.table_v.end_it;
+    return this->data_.table_v.current_it == this->data_.table_v.ref->end();
   default:
     assert(false);
   }
@@ -48,12 +46,10 @@ bool Iterator::ended()const{
 void Iterator::advance(){
   switch(this->type_){
   case TypeTag::Array:
-    this->data_.array_v.current_it =
-      std::next(this->data_.array_v.current_it);
+    ++this->data_.array_v.index;
     break;
   case TypeTag::Table:
-    this->data_.table_v.current_it =
-      std::next(this->data_.table_v.current_it);
+    ++this->data_.table_v.current_it;
     break;
   default:
     assert(false);
@@ -63,10 +59,7 @@ void Iterator::advance(){
 TypedValue Iterator::getKey()const{
   switch(this->type_){
   case TypeTag::Array:
-    return TypedValue(
-      this->data_.array_v.current_it -
-      this->data_.array_v.ref->begin()
-    );
+    return TypedValue((Int)this->data_.array_v.index);
   case TypeTag::Table:
     return this->data_.table_v.current_it->first;
   default:
@@ -78,7 +71,7 @@ TypedValue Iterator::getKey()const{
 TypedValue Iterator::getValue()const{
   switch(this->type_){
   case TypeTag::Array:
-    return *this->data_.array_v.current_it;
+    return (*this->data_.array_v.ref)[this->data_.array_v.index];
   case TypeTag::Table:
     return this->data_.table_v.current_it->second;
   default:
@@ -2,6 +2,7 @@
 #define ITERATOR_H_INCLUDED
 
 #include "rc_mixin.h"
+#include "object_pools.h"
 #include "value.h"
 #include "array.h"
 #include "table.h"
@@ -14,13 +15,11 @@ class Iterator: public RcDirectMixin<Iterator> {
   
   struct ArrayIterator {
     Array* ref;
-    Array::iterator current_it;
-    Array::iterator end_it;
+    size_t index;
   };
   struct TableIterator {
     Table* ref;
-    Table::iterator current_it;
-    Table::iterator end_it;
+    Table::const_iterator current_it;
   };
   
   TypeTag type_;
@@ -45,8 +44,11 @@ public:
   TypedValue getKey()const;
   TypedValue getValue()const;
   
+  static void* operator new(size_t size){
+    return ObjectPools::allocate(size);
+  }
   void operator delete(void* ptr){
-    ::operator delete(ptr);
+    ObjectPools::deallocate(ptr);
   }
   
   #ifndef NDEBUG
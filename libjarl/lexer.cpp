@@ -560,12 +560,12 @@ yy46:
         String* str;
         auto it = this->string_table.find(view);
         if(it == this->string_table.end()){
-          str = this->string_table.insert(
-            std::make_pair(
-              view,
-              rc_ptr<String>(make_new<String>(view.first, view.second))
-            )
-          ).first->second.get();
+          str = make_new<String>(view.first, view.second)->intern();
+          this->string_table.insert(
+            std::make_pair(view, rc_ptr<String>(str))
+          );
+          //the table keeps the string alive without the reference taken by intern
+          str->decRefCount();
         }else{
           str = it->second.get();
         }
@@ -2863,8 +2863,9 @@ yy203:
 	YYDEBUG(204, *reader);
 #line 326 "../re2c/lexer.re"
 	{
-          String* new_str = make_new<String>(str.c_str(), str.c_str() + str.size());
-          this->strings_.emplace_back(new_str);
+          String* new_str =
+            make_new<String>(str.c_str(), str.c_str() + str.size())->intern();
+          this->strings_.emplace_back(new_str)->decRefCount();
           PLACE_LEXEME(new_str);
           continue;
         }
@@ -7,6 +7,8 @@
 
 #include <cstdio>
 #include <cstdarg>
+#include <cstdint>
+#include <cstring>
 
 #ifndef NDEBUG
 #include <string>
@@ -50,6 +52,63 @@ inline char* dynSprintf(const char* format, ...){
   return buffer;
 }
 
+#ifdef __SIZEOF_INT128__
+
+inline uint64_t hashMix_(uint64_t a, uint64_t b){
+  __uint128_t r = static_cast<__uint128_t>(a) * b;
+  return static_cast<uint64_t>(r) ^ static_cast<uint64_t>(r >> 64);
+}
+inline uint64_t hashRead8_(const char* p){
+  uint64_t ret;
+  memcpy(&ret, p, 8);
+  return ret;
+}
+inline uint64_t hashRead4_(const char* p){
+  uint32_t ret;
+  memcpy(&ret, p, 4);
+  return ret;
+}
+
+/*
+  Hashes 16 bytes per round with a 64x64->128 bit multiply, after wyhash. Inputs of
+  up to 16 bytes are read with at most four overlapping loads.
+*/
+inline size_t defaultHash(const char* from, const char* to){
+  constexpr uint64_t _s0 = 0xa0761d6478bd642full;
+  constexpr uint64_t _s1 = 0xe7037ed1a0b428dbull;
+  constexpr uint64_t _s2 = 0x8ebc6af09c88c6e3ull;
+  
+  size_t len = to - from;
+  uint64_t seed = _s2;
+  uint64_t a, b;
+  
+  if(len <= 16){
+    if(len >= 4){
+      size_t step = (len >> 3) << 2;
+      a = (hashRead4_(from) << 32) | hashRead4_(from + step);
+      b = (hashRead4_(to - 4) << 32) | hashRead4_(to - 4 - step);
+    }else if(len > 0){
+      a = (static_cast<uint64_t>(static_cast<unsigned char>(from[0])) << 16)
+        | (static_cast<uint64_t>(static_cast<unsigned char>(from[len >> 1])) << 8)
+        | static_cast<unsigned char>(to[-1]);
+      b = 0;
+    }else{
+      a = b = 0;
+    }
+  }else{
+    for(; to - from > 16; from += 16){
+      seed = hashMix_(hashRead8_(from) ^ _s1, hashRead8_(from + 8) ^ seed);
+    }
+    a = hashRead8_(to - 16);
+    b = hashRead8_(to - 8);
+  }
+  
+  __uint128_t r = static_cast<__uint128_t>(a ^ _s1) * (b ^ seed);
+  return hashMix_(static_cast<uint64_t>(r) ^ _s0 ^ len, static_cast<uint64_t>(r >> 64) ^ _s1);
+}
+
+#else
+
 inline size_t defaultHash(const char* from, const char* to){
   constexpr size_t _offset = sizeof(size_t) == 8?
     0xcbf29ce484222325 : 0x811c9dc5;
@@ -64,6 +123,8 @@ inline size_t defaultHash(const char* from, const char* to){
   return ret;
 }
 
+#endif
+
 #ifndef NDEBUG
 inline std::string unlexString(const char* str){
   std::string ret = "\"";
@@ -0,0 +1,334 @@
+#ifndef NAN_BOX_H_INCLUDED
+#define NAN_BOX_H_INCLUDED
+
+#include "rc_mixin.h"
+#include "object_pools.h"
+
+#include <cstdint>
+#include <cstring>
+
+#ifndef NDEBUG
+#include <string>
+#endif
+
+/*
+  The compact layout of TypedValue, used when built with NAN_BOXED_VALUES.
+
+  A value is a single 64 bit word. Floats are stored as themselves, except that
+  every NaN is stored as the same quiet NaN. Everything else lives in the rest of
+  the quiet NaN space: the sign bit and the low three bits of the exponent word
+  hold a tag, and the low 48 bits hold the payload. Pointers fit in 48 bits on the
+  64 bit platforms we support. Ints are stored inline if they fit in 48 bits, larger
+  ints are boxed in a reference counted IntBox, but still report their type as Int.
+
+  TypedValue exposes the word through the same type and value members as the wide
+  layout. Here they are proxies that decode the word when read and encode it when
+  written, so code written against one layout works with the other. Writing a field
+  of value tags the word with the type of that field, and writing type keeps the
+  payload, so the type and the value may be written in either order. Writing type
+  Float does nothing, the word becomes a float when float_v is written.
+  
+  There is no room for small strings in a word, so this layout never uses the
+  SmallString tag.
+*/
+
+static_assert(sizeof(void*) == 8, "NaN boxing needs 64 bit pointers");
+
+class TypedValue;
+
+namespace NanBox {
+
+  constexpr uint64_t PayloadMask = 0x0000ffffffffffffull;
+  constexpr uint64_t CanonicalNaN = 0x7ff8000000000000ull;
+  constexpr Int MinInline = -(Int(1) << 47);
+  constexpr Int MaxInline = (Int(1) << 47) - 1;
+
+  // tag 0 is a float, tags 1 to 14 are the type tags plus one
+  constexpr unsigned BoxedIntTag = 15;
+
+  constexpr unsigned tagFor(TypeTag type){
+    return static_cast<unsigned>(type) + 1;
+  }
+  constexpr uint64_t tagBits(unsigned tag){
+    return (uint64_t(tag & 8) << 60) | (uint64_t(0x7ff8 | (tag & 7)) << 48);
+  }
+  constexpr unsigned tagOf(uint64_t bits){
+    return (static_cast<unsigned>(bits >> 48) & 0x7ff8) != 0x7ff8?
+      0 : (static_cast<unsigned>(bits >> 60) & 8) | (static_cast<unsigned>(bits >> 48) & 7);
+  }
+
+  constexpr TypeTag TagTypes_[16] = {
+    TypeTag::Float, TypeTag::None, TypeTag::Null, TypeTag::Ptr,
+    TypeTag::Bool, TypeTag::Int, TypeTag::Float, TypeTag::String,
+    TypeTag::Func, TypeTag::Partial, TypeTag::Array, TypeTag::Table,
+    TypeTag::Iterator, TypeTag::Borrow, TypeTag::SmallString, TypeTag::Int
+  };
+  constexpr TypeTag typeOf(uint64_t bits){
+    return TagTypes_[tagOf(bits)];
+  }
+
+  constexpr uint64_t NoneBits = tagBits(tagFor(TypeTag::None));
+  constexpr uint64_t NullBits = tagBits(tagFor(TypeTag::Null));
+
+  struct IntBox: public RcDirectMixin<IntBox> {
+    const Int value;
+
+    explicit IntBox(Int value): value(value){}
+
+    static void* operator new(size_t size){
+      return ObjectPools::allocate(size);
+    }
+    void operator delete(void* ptr){
+      ObjectPools::deallocate(ptr);
+    }
+  };
+
+  inline IntBox* intBox(uint64_t bits){
+    return reinterpret_cast<IntBox*>(bits & PayloadMask);
+  }
+
+  // boxed ints are the only words that hold a reference of their own
+  inline void retain(uint64_t bits){
+    if(tagOf(bits) == BoxedIntTag) intBox(bits)->incRefCount();
+  }
+  inline void release(uint64_t bits){
+    if(tagOf(bits) == BoxedIntTag) intBox(bits)->decRefCount();
+  }
+
+  inline uint64_t encodePointer(unsigned tag, const void* ptr){
+    return tagBits(tag) | (reinterpret_cast<uintptr_t>(ptr) & PayloadMask);
+  }
+  inline uint64_t encodeInt(Int i){
+    if(i >= MinInline && i <= MaxInline){
+      return tagBits(tagFor(TypeTag::Int)) | (static_cast<uint64_t>(i) & PayloadMask);
+    }
+    IntBox* box = new IntBox(i);
+    box->incRefCount();
+    return encodePointer(BoxedIntTag, box);
+  }
+  inline uint64_t encodeFloat(Float f){
+    if(f != f) return CanonicalNaN;
+    uint64_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return bits;
+  }
+
+  /*
+    Reading a field of another type reinterprets the word, as with the union of the
+    wide layout.
+  */
+  inline Int decodeInt(uint64_t bits){
+    switch(tagOf(bits)){
+    case 0:
+      return static_cast<Int>(bits);
+    case tagFor(TypeTag::Int):
+      return static_cast<Int>(bits << 16) >> 16;
+    case BoxedIntTag:
+      return intBox(bits)->value;
+    default:
+      return static_cast<Int>(bits & PayloadMask);
+    }
+  }
+  inline Float decodeFloat(uint64_t bits){
+    Float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+  }
+
+  class Field_{
+  protected:
+    uint64_t bits_;
+
+    void store_(uint64_t bits){
+      release(this->bits_);
+      this->bits_ = bits;
+    }
+
+  public:
+    Field_() = default;
+    // fields only exist inside a TypedValue, and can not be copied out of one
+    Field_(const Field_&) = delete;
+  };
+
+  class TypeField: public Field_ {
+    friend class ::TypedValue;
+
+  public:
+    TypeField(){
+      this->bits_ = NoneBits;
+    }
+
+    constexpr operator TypeTag()const{
+      return typeOf(this->bits_);
+    }
+    explicit operator Int()const{
+      return static_cast<Int>(typeOf(this->bits_));
+    }
+
+    TypeField& operator=(TypeTag type){
+      if(type == TypeTag::Float) return *this;
+      unsigned tag = tagOf(this->bits_);
+      uint64_t payload = this->bits_ & PayloadMask;
+      if(tag == BoxedIntTag){
+        if(type == TypeTag::Int) return *this;
+        intBox(this->bits_)->decRefCount();
+        payload = 0;
+      }else if(tag == 0 || type == TypeTag::None || type == TypeTag::Null){
+        payload = 0;
+      }
+      this->bits_ = tagBits(tagFor(type)) | payload;
+      return *this;
+    }
+    TypeField& operator=(const TypeField& other){
+      return *this = static_cast<TypeTag>(other);
+    }
+  };
+
+  class BoolField: public Field_ {
+  public:
+    operator bool()const{
+      return (this->bits_ & PayloadMask) != 0;
+    }
+    BoolField& operator=(bool b){
+      this->store_(tagBits(tagFor(TypeTag::Bool)) | b);
+      return *this;
+    }
+    BoolField& operator=(const BoolField& other){
+      return *this = static_cast<bool>(other);
+    }
+  };
+
+  class IntField: public Field_ {
+  public:
+    operator Int()const{
+      return decodeInt(this->bits_);
+    }
+    IntField& operator=(Int i){
+      this->store_(encodeInt(i));
+      return *this;
+    }
+    IntField& operator=(const IntField& other){
+      return *this = static_cast<Int>(other);
+    }
+    IntField& operator+=(Int i){
+      return *this = static_cast<Int>(*this) + i;
+    }
+    IntField& operator-=(Int i){
+      return *this = static_cast<Int>(*this) - i;
+    }
+    IntField& operator*=(Int i){
+      return *this = static_cast<Int>(*this) * i;
+    }
+    IntField& operator/=(Int i){
+      return *this = static_cast<Int>(*this) / i;
+    }
+    IntField& operator%=(Int i){
+      return *this = static_cast<Int>(*this) % i;
+    }
+  };
+
+  class FloatField: public Field_ {
+  public:
+    operator Float()const{
+      return decodeFloat(this->bits_);
+    }
+    FloatField& operator=(Float f){
+      this->store_(encodeFloat(f));
+      return *this;
+    }
+    FloatField& operator=(const FloatField& other){
+      return *this = static_cast<Float>(other);
+    }
+    FloatField& operator+=(Float f){
+      return *this = static_cast<Float>(*this) + f;
+    }
+    FloatField& operator-=(Float f){
+      return *this = static_cast<Float>(*this) - f;
+    }
+    FloatField& operator*=(Float f){
+      return *this = static_cast<Float>(*this) * f;
+    }
+    FloatField& operator/=(Float f){
+      return *this = static_cast<Float>(*this) / f;
+    }
+  };
+
+  template<class T, TypeTag Type>
+  class PointerField: public Field_ {
+  public:
+    operator T*()const{
+      return reinterpret_cast<T*>(this->bits_ & PayloadMask);
+    }
+    T* operator->()const{
+      return *this;
+    }
+    T& operator*()const{
+      return *static_cast<T*>(*this);
+    }
+    PointerField& operator=(T* ptr){
+      this->store_(encodePointer(tagFor(Type), ptr));
+      return *this;
+    }
+    PointerField& operator=(const PointerField& other){
+      return *this = static_cast<T*>(other);
+    }
+  };
+
+  /*
+    ptr_v keeps the tag of words that already hold a pointer or null, so it can be
+    written after the type.
+  */
+  class RawPointerField: public Field_ {
+  public:
+    operator void*()const{
+      return reinterpret_cast<void*>(this->bits_ & PayloadMask);
+    }
+    RawPointerField& operator=(void* ptr){
+      unsigned tag = tagOf(this->bits_);
+      if(
+        tag == 0 || tag == BoxedIntTag
+        || tag == tagFor(TypeTag::Int) || tag == tagFor(TypeTag::Bool)
+      ){
+        tag = tagFor(TypeTag::Ptr);
+      }
+      this->store_(encodePointer(tag, ptr));
+      return *this;
+    }
+    RawPointerField& operator=(const RawPointerField& other){
+      return *this = static_cast<void*>(other);
+    }
+  };
+
+  struct ValueField{
+    union{
+      BoolField                                       bool_v;
+      IntField                                        int_v;
+      FloatField                                      float_v;
+      PointerField<String, TypeTag::String>           string_v;
+      PointerField<Function, TypeTag::Func>           func_v;
+      PointerField<PartiallyApplied, TypeTag::Partial> partial_v;
+      PointerField<Array, TypeTag::Array>             array_v;
+      PointerField<Table, TypeTag::Table>             table_v;
+      PointerField<TypedValue, TypeTag::Borrow>       borrowed_v;
+      PointerField<Iterator, TypeTag::Iterator>       iterator_v;
+      RawPointerField                                 ptr_v;
+    };
+    
+    #ifndef NDEBUG
+    std::string boolToStrDebug()const{
+      return std::string(this->bool_v? "true" : "false");
+    }
+    std::string intToStrDebug()const{
+      return std::to_string(static_cast<Int>(this->int_v));
+    }
+    std::string floatToStrDebug()const{
+      return std::to_string(static_cast<Float>(this->float_v));
+    }
+    std::string toStrDebug()const{
+      return std::string(this->string_v->str());
+    }
+    #endif
+  };
+}
+
+#endif
@@ -0,0 +1,58 @@
+#include "object_pools.h"
+
+#include "pool_allocator.h"
+
+#include <cassert>
+
+namespace{
+  
+  // 16 byte steps up to 256, then 64 byte steps up to MaxCellSize
+  constexpr size_t NumSizeClasses_ = 16 + (ObjectPools::MaxCellSize - 256) / 64;
+  
+  inline size_t sizeClass_(size_t size){
+    if(size <= 256) return size == 0? 0 : (size - 1) / 16;
+    else return 16 + (size - 257) / 64;
+  }
+  inline size_t classSize_(size_t size_class){
+    if(size_class < 16) return (size_class + 1) * 16;
+    else return 256 + (size_class - 15) * 64;
+  }
+  
+  thread_local PoolAllocator* pools_[NumSizeClasses_];
+  
+  /*
+    Releases the pools of a thread when it exits. Pools with cells still in use are
+    orphaned, and released once their last cell is freed.
+  */
+  struct PoolsCleanup_{
+    ~PoolsCleanup_(){
+      for(auto& pool: pools_){
+        delete pool;
+        pool = nullptr;
+      }
+    }
+  };
+  thread_local PoolsCleanup_ pools_cleanup_;
+  
+  PoolAllocator* makePool_(size_t size_class){
+    //touching the cleanup object registers its destructor for this thread
+    (void)&pools_cleanup_;
+    pools_[size_class] = new PoolAllocator(classSize_(size_class));
+    return pools_[size_class];
+  }
+}
+
+namespace ObjectPools {
+  
+  void* allocate(size_t size){
+    assert(size <= MaxCellSize);
+    size_t size_class = sizeClass_(size);
+    PoolAllocator* pool = pools_[size_class];
+    if(pool == nullptr) pool = makePool_(size_class);
+    return pool->allocate();
+  }
+  
+  void deallocate(void* ptr){
+    PoolAllocator::deallocate(ptr);
+  }
+}
@@ -0,0 +1,24 @@
+#ifndef OBJECT_POOLS_H_INCLUDED
+#define OBJECT_POOLS_H_INCLUDED
+
+#include <cstddef>
+
+/*
+  Size class pools for the objects of the runtime. Sizes up to MaxCellSize are
+  rounded up to a size class and allocated from a PoolAllocator of that class.
+  Each thread has its own pools, so allocation takes no locks. Larger blocks are
+  not pooled, and are allocated with new by their owners.
+  
+  Memory from allocate() may be freed with deallocate() on any thread, and the size
+  is not needed to free it.
+*/
+
+namespace ObjectPools {
+  
+  constexpr size_t MaxCellSize = 1024;
+  
+  void* allocate(size_t size);
+  void deallocate(void* ptr);
+}
+
+#endif
@@ -22,9 +22,15 @@ std::string OpCodes::opCodeToStrDebug(OpCodes::Type op){
   case OpCodes::Reduce:
     ret += "reduce"s;
     break;
+  case OpCodes::Swap:
+    ret += "swap"s;
+    break;
   case OpCodes::Push:
     ret += "push"s;
     break;
+  case OpCodes::PushCapture:
+    ret += "push capture"s;
+    break;
   case OpCodes::PushTrue:
     ret += "push true"s;
     break;
@@ -17,10 +17,12 @@ namespace OpCodes {
     Nop,
     
     Push,
+    PushCapture,
     PushTrue,
     PushFalse,
     Pop,
     Reduce,
+    Swap,
     Write,
     Add,
     Sub,
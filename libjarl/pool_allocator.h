@@ -32,150 +32,357 @@
   
   @section DESCRIPTION
   
-  A simple pool allocator template. Improves allocation/deallocation times and locality
-  of reference for the pooled objects.
+  A pool allocator for cells of one size. Improves allocation/deallocation times and
+  locality of reference for the pooled objects.
   
   usage:
   
-  simply declare a PoolAllocator object and overload the new and delete operators for
-  the object you want to pool.
+  create a PoolAllocator for each cell size and overload the new and delete operators
+  of the objects you want to pool, see object_pools.h.
 */
 
+#include <atomic>
+#include <new>
+#include <thread>
+#include <cstddef>
+
 /**
-  @brief Pool allocator template.
-  @param CellSize Size in bytes of each object allocated in the pool.
-  @param PoolSize Number of objects per pool.
-  @param MaxPools Maximum number of pools. When memory in the existing pools runs out
-  PoolAllocator will allocate more memory with operator new. This limits the number of
-  pools the allocator can allocate. default: 64
+  @brief Pool allocator.
+  
+  Cells are carved out of pools of PoolSize bytes. Pools are aligned to PoolSize, so
+  the pool holding a cell is found from the address of the cell, and deallocate()
+  needs neither the allocator nor the size. New pools are allocated as needed, and a
+  pool is released as soon as all its cells are free, except for the pool currently
+  allocated from.
+  
+  An allocator belongs to the thread that created it. Cells freed on other threads
+  are pushed to a lock free list in their pool, and are taken back by the owner the
+  next time it runs out of free cells. When the allocator is destroyed, its pools
+  with cells still in use are orphaned, and released by the last of those cells to
+  be freed.
 */
-template<unsigned CellSize, unsigned PoolSize, unsigned MaxPools = 64>
 class PoolAllocator
 {
+public:
+
+  static constexpr size_t PoolSize = 64 * 1024;
+
 private:
 
-  union Block
+  struct Cell_
   {
-    Block* next;
-    char padding[CellSize];
-    //T t;
+    Cell_* next;
   };
 
-  Block* memory_[MaxPools];
-  Block* next_;
-
-public:
-
-  /**
-    @brief Allocates memory from the pool
+  struct Pool_
+  {
+    std::atomic<PoolAllocator*> owner;
+    const void* thread;
+    //the list of pools with free cells
+    Pool_* prev;
+    Pool_* next;
+    bool listed;
+    //the list of all pools of the owner
+    Pool_* all_prev;
+    Pool_* all_next;
     
-    To pool a specific type of object overload it's new operator to use this function.
-    If there is not enough memory in the pool it will allocate another pool. If the
-    number of pools exceeds MaxPools it will fail disgracefully.
+    Cell_* free;
+    char* bump;
+    char* end;
+    size_t live;
     
-    @return Pointer to a free cell of memory in the pool.
-  */
-  void* allocate()
+    std::atomic<Cell_*> remote_free;
+    Pool_* next_remote;
+    //remote frees in progress, which may still use the owner
+    std::atomic<unsigned> remote_users;
+    //once orphaned, the cells in use, less the cells freed before it was counted
+    std::atomic<ptrdiff_t> orphan_live;
+  };
+
+  static constexpr size_t HeaderSize_ = (sizeof(Pool_) + 63) / 64 * 64;
+
+  static const void* currentThread_()
+  {
+    static thread_local char token;
+    return &token;
+  }
+  static Pool_* poolOf_(void* cell)
   {
-    if(next_ == nullptr)
-      reserve();
+    return (Pool_*)((size_t)cell & ~(PoolSize - 1));
+  }
+  //marks the remote list of an orphaned pool
+  static Cell_* orphaned_()
+  {
+    static Cell_ tag;
+    return &tag;
+  }
 
-    Block* block = next_;
-    next_ = next_->next;
-    return (void*)block;
+  size_t cell_size_;
+  Pool_* current_;
+  Pool_* partial_;
+  Pool_* pools_;
+  size_t live_;
+  std::atomic<Pool_*> remote_pools_;
+
+  Pool_* newPool_()
+  {
+    Pool_* pool = (Pool_*)::operator new(PoolSize, std::align_val_t(PoolSize));
+    new(&pool->owner) std::atomic<PoolAllocator*>(this);
+    pool->thread = currentThread_();
+    pool->prev = pool->next = nullptr;
+    pool->listed = false;
+    pool->all_prev = nullptr;
+    pool->all_next = pools_;
+    if(pools_) pools_->all_prev = pool;
+    pools_ = pool;
+    pool->free = nullptr;
+    pool->bump = (char*)pool + HeaderSize_;
+    pool->end = (char*)pool + PoolSize;
+    pool->live = 0;
+    new(&pool->remote_free) std::atomic<Cell_*>(nullptr);
+    pool->next_remote = nullptr;
+    new(&pool->remote_users) std::atomic<unsigned>(0);
+    new(&pool->orphan_live) std::atomic<ptrdiff_t>(0);
+    return pool;
+  }
+  void releasePool_(Pool_* pool)
+  {
+    if(pool->all_prev) pool->all_prev->all_next = pool->all_next;
+    else pools_ = pool->all_next;
+    if(pool->all_next) pool->all_next->all_prev = pool->all_prev;
+    freePool_(pool);
+  }
+  static void freePool_(Pool_* pool)
+  {
+    ::operator delete(pool, std::align_val_t(PoolSize));
   }
 
-  /**
-    @brief Allocates memory from the pool
-    
-    To pool a specific type of object overload it's new operator to use this function.
-    If there is not enough memory in the pool it will allocate another pool. If the
-    number of pools exceeds MaxPools it will fail disgracefully.
+  void link_(Pool_* pool)
+  {
+    pool->prev = nullptr;
+    pool->next = partial_;
+    if(partial_) partial_->prev = pool;
+    partial_ = pool;
+    pool->listed = true;
+  }
+  void unlink_(Pool_* pool)
+  {
+    if(pool->prev) pool->prev->next = pool->next;
+    else partial_ = pool->next;
+    if(pool->next) pool->next->prev = pool->prev;
+    pool->listed = false;
+  }
+
+  void* allocateSlow_()
+  {
+    drainRemote_();
+    if(
+      current_ == nullptr
+      || (current_->free == nullptr && current_->bump + cell_size_ > current_->end)
+    )
+    {
+      if(partial_)
+      {
+        current_ = partial_;
+        unlink_(current_);
+      }
+      else
+        current_ = newPool_();
+    }
+    return allocate();
+  }
+
+  void deallocateLocal_(Pool_* pool, Cell_* cell)
+  {
+    cell->next = pool->free;
+    pool->free = cell;
+    --pool->live;
+    --live_;
+    if(pool == current_) return;
+    if(pool->live == 0)
+    {
+      if(pool->listed) unlink_(pool);
+      releasePool_(pool);
+    }
+    else if(!pool->listed)
+      link_(pool);
+  }
+
+  static void deallocateRemote_(Pool_* pool, Cell_* cell)
+  {
+    pool->remote_users.fetch_add(1, std::memory_order_acq_rel);
+    //acquire pairs with the owner draining the list, so that the owner is done with
+    //next_remote before the pool is queued again
+    Cell_* head = pool->remote_free.load(std::memory_order_acquire);
+    do
+    {
+      if(head == orphaned_())
+      {
+        pool->remote_users.fetch_sub(1, std::memory_order_release);
+        deallocateOrphaned_(pool, 1);
+        return;
+      }
+      cell->next = head;
+    }
+    while(!pool->remote_free.compare_exchange_weak(
+      head, cell, std::memory_order_acq_rel, std::memory_order_acquire
+    ));
     
-    @param size This argument is simply ignored.
-    @return Memory adress of a free cell in the pool.
+    //the first remote free queues the pool with its owner, which is kept alive
+    //until remote_users drops to zero
+    if(head == nullptr)
+    {
+      PoolAllocator* owner = pool->owner.load(std::memory_order_acquire);
+      Pool_* pools = owner->remote_pools_.load(std::memory_order_relaxed);
+      do
+        pool->next_remote = pools;
+      while(!owner->remote_pools_.compare_exchange_weak(
+        pools, pool, std::memory_order_release, std::memory_order_relaxed
+      ));
+    }
+    pool->remote_users.fetch_sub(1, std::memory_order_release);
+  }
+
+  /*
+    Counts freed cells of an orphaned pool, from either side. The count starts at
+    zero, the frees on other threads take from it and the owner adds the cells in
+    use when it orphans the pool, so whoever brings it back to zero is the last.
   */
-  void* allocate(size_t size)
+  static void deallocateOrphaned_(Pool_* pool, ptrdiff_t freed)
   {
-    if(next_ == nullptr)
-      reserve();
+    if(pool->orphan_live.fetch_sub(freed, std::memory_order_acq_rel) == freed)
+      freePool_(pool);
+  }
 
-    Block* block = next_;
-    next_ = next_->next;
-    return (void*)block;
+  void orphan_(Pool_* pool)
+  {
+    pool->owner.store(nullptr, std::memory_order_relaxed);
+    Cell_* cell = pool->remote_free.exchange(orphaned_(), std::memory_order_acq_rel);
+    while(pool->remote_users.load(std::memory_order_acquire) != 0)
+      std::this_thread::yield();
+    for(; cell; cell = cell->next)
+      --pool->live;
+    if(pool->live == 0)
+      freePool_(pool);
+    else
+      deallocateOrphaned_(pool, -(ptrdiff_t)pool->live);
   }
 
+  void drainRemote_()
+  {
+    if(remote_pools_.load(std::memory_order_relaxed) == nullptr) return;
+    Pool_* pool = remote_pools_.exchange(nullptr, std::memory_order_acquire);
+    while(pool)
+    {
+      Pool_* next = pool->next_remote;
+      Cell_* cell = pool->remote_free.exchange(nullptr, std::memory_order_acq_rel);
+      while(cell)
+      {
+        Cell_* next_cell = cell->next;
+        deallocateLocal_(pool, cell);
+        cell = next_cell;
+      }
+      pool = next;
+    }
+  }
+
+public:
+
   /**
-    @brief deallocates memory
-    
-    To pool a specific type of object overload it's delete operaator to use this
-    function.
-    
-    @param block Pointer to the cell to free. This must point to a cell allocated with
-    the same PoolAllocator objects allocate function.
+    @param cell_size Size in bytes of each cell. Must be a multiple of 16.
+  */
+  explicit PoolAllocator(size_t cell_size):
+    cell_size_(cell_size),
+    current_(nullptr),
+    partial_(nullptr),
+    pools_(nullptr),
+    live_(0),
+    remote_pools_(nullptr)
+  {}
+  PoolAllocator(const PoolAllocator&) = delete;
+  void operator=(const PoolAllocator&) = delete;
+
+  /**
+    @brief Releases the free pools, and orphans those with cells still in use. Must
+    be called on the thread that created the allocator.
   */
-  void deallocate(void* block)
+  ~PoolAllocator()
   {
-    ((Block*)block)->next = next_;
-    next_ = (Block*)block;
+    drainRemote_();
+    Pool_* pool = pools_;
+    while(pool)
+    {
+      Pool_* next = pool->all_next;
+      orphan_(pool);
+      pool = next;
+    }
   }
 
   /**
-    @brief Preallocates a number of pools.
-    
-    Allocating more pools than MaxPools will fail disgracefully.
-    
-    @param num_pools Number of pools to preallocate. Default: 1
+    @brief Allocates a cell. Must be called on the thread that created the allocator.
+    @return Pointer to a free cell of memory in the pool.
   */
-  void reserve(unsigned num_pools = 1)
+  void* allocate()
   {
-    for(auto& chunk: memory_)
+    Pool_* pool = current_;
+    if(pool)
     {
-      if(chunk == nullptr)
+      if(pool->free)
       {
-        chunk = new Block[PoolSize];
-
-        for(unsigned m = 0; m < PoolSize - 1; ++m)
-          chunk[m].next = &chunk[m + 1];
-
-        chunk[PoolSize - 1].next = next_;
-        next_ = chunk;
-        break;
+        Cell_* cell = pool->free;
+        pool->free = cell->next;
+        ++pool->live;
+        ++live_;
+        return cell;
+      }
+      if(pool->bump + cell_size_ <= pool->end)
+      {
+        void* cell = pool->bump;
+        pool->bump += cell_size_;
+        ++pool->live;
+        ++live_;
+        return cell;
       }
     }
-    if(num_pools != 1) reserve(num_pools - 1);
+    return allocateSlow_();
   }
 
   /**
-    @brief Deallocates all pools.
-    
-    Destructors of the objects already allocated will not be called. All pointers to
-    memory in the pool will be invalidated.
+    @brief Frees a cell allocated by any PoolAllocator, from any thread.
   */
-  void clear()
+  static void deallocate(void* cell)
   {
-    next_ = nullptr;
-
-    for(auto& chunk: memory_)
+    Pool_* pool = poolOf_(cell);
+    if(pool->thread == currentThread_())
     {
-      delete chunk;
-      chunk = nullptr;
+      //only the owner clears owner, so it is only null here once orphaned
+      PoolAllocator* owner = pool->owner.load(std::memory_order_relaxed);
+      if(owner)
+      {
+        owner->deallocateLocal_(pool, (Cell_*)cell);
+        return;
+      }
     }
+    deallocateRemote_(pool, (Cell_*)cell);
   }
 
-  PoolAllocator()
+  /**
+    @brief Takes back the cells freed on other threads. Must be called on the thread
+    that created the allocator.
+  */
+  void collect()
   {
-    next_ = nullptr;
-    for(auto& c: memory_)
-      c = nullptr;
+    drainRemote_();
   }
-  PoolAllocator(const PoolAllocator&) = delete;
-  void operator=(const PoolAllocator&) = delete;
-  
-  ~PoolAllocator()
+
+  /**
+    @brief Number of cells currently allocated, counting cells freed on other
+    threads until they are collected.
+  */
+  size_t live()const
   {
-    this->clear();
+    return live_;
   }
 };
 
-#endif
\ No newline at end of file
+#endif
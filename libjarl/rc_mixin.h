@@ -2,7 +2,9 @@
 #define RC_MIXIN_H_INCLUDED
 
 #include <cstddef>
+#include <cstdint>
 #include <new>
+#include <atomic>
 #include <type_traits>
 
 #ifndef NDEBUG
@@ -15,35 +17,191 @@ class rc_ptr;
 template<class T>
 class rc_weak_ptr;
 
-template<class T>
+/*
+  Reference count policies. A policy holds one count and provides inc(), dec(),
+  which returns true when the count drops to zero, tryInc(), which increments the
+  count unless it is zero and returns whether it did, get() and reset(). WeakPolicy
+  is the policy used for the weak count of the same object.
+*/
+
+/**
+  @brief Non-atomic count of the given width. Objects may only be referred to from
+  one thread.
+*/
+template<class Count>
+class RcPlain{
+  Count count_;
+  
+public:
+  typedef RcPlain WeakPolicy;
+  
+  RcPlain(): count_(0){}
+  
+  void reset(){count_ = 0;}
+  void inc(){++count_;}
+  bool dec(){return --count_ == 0;}
+  bool tryInc(){
+    if(count_ == 0) return false;
+    ++count_;
+    return true;
+  }
+  Count get()const{return count_;}
+};
+
+/**
+  @brief Atomic count of the given width.
+*/
+template<class Count>
+class RcAtomic{
+  std::atomic<Count> count_;
+  
+public:
+  typedef RcAtomic WeakPolicy;
+  
+  RcAtomic(): count_(0){}
+  
+  void reset(){count_.store(0, std::memory_order_relaxed);}
+  void inc(){count_.fetch_add(1, std::memory_order_relaxed);}
+  bool dec(){return count_.fetch_sub(1, std::memory_order_acq_rel) == 1;}
+  bool tryInc(){
+    Count count = count_.load(std::memory_order_relaxed);
+    do{
+      if(count == 0) return false;
+    }while(!count_.compare_exchange_weak(count, count + 1, std::memory_order_relaxed));
+    return true;
+  }
+  Count get()const{return count_.load(std::memory_order_relaxed);}
+};
+
+/**
+  @brief Biased count. The thread that created the object counts its references
+  without atomics, other threads count theirs in an atomic shared count.
+  
+  While the owning thread holds references they count as one in the shared count.
+  The owner only touches the shared count atomically when it takes its first
+  reference after having released all of them, or when it releases its last
+  reference. Objects that are never shared are counted with a single atomic
+  operation, when they are released. The shared count drops to zero with the last
+  reference, so tryInc() from another thread can not revive a released object.
+  get() is only exact on the owning thread. Other threads only see the shared
+  count, which may be higher than the true count but never lower, so an object
+  shared with the owner is never unique to them.
+*/
+class RcBiased{
+  static const void* currentThread_(){
+    static thread_local char token;
+    return &token;
+  }
+  
+  const void* owner_;
+  uint32_t biased_;
+  //whether the references of the owner are counted in shared_
+  bool held_;
+  std::atomic<uint32_t> shared_;
+  
+public:
+  typedef RcAtomic<uint32_t> WeakPolicy;
+  
+  RcBiased(): owner_(currentThread_()), biased_(0), held_(true), shared_(1){}
+  
+  void reset(){
+    owner_ = currentThread_();
+    biased_ = 0;
+    held_ = true;
+    shared_.store(1, std::memory_order_relaxed);
+  }
+  void inc(){
+    if(owner_ == currentThread_()){
+      if(!held_){
+        shared_.fetch_add(1, std::memory_order_relaxed);
+        held_ = true;
+      }
+      ++biased_;
+    }else{
+      shared_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  bool dec(){
+    if(owner_ == currentThread_()){
+      if(--biased_ != 0) return false;
+      held_ = false;
+    }
+    return shared_.fetch_sub(1, std::memory_order_acq_rel) == 1;
+  }
+  bool tryInc(){
+    bool owner = owner_ == currentThread_();
+    if(owner && held_){
+      //the owner's references keep the shared count from dropping to zero
+      if(biased_ == 0 && shared_.load(std::memory_order_acquire) == 1) return false;
+      ++biased_;
+      return true;
+    }
+    uint32_t count = shared_.load(std::memory_order_relaxed);
+    do{
+      if(count == 0) return false;
+    }while(!shared_.compare_exchange_weak(count, count + 1, std::memory_order_relaxed));
+    if(owner){
+      held_ = true;
+      ++biased_;
+    }
+    return true;
+  }
+  uint32_t get()const{
+    //acquire pairs with dec(), so that a count of one sees the writes of the
+    //threads that released their references
+    uint32_t shared = shared_.load(std::memory_order_acquire);
+    if(owner_ != currentThread_()) return shared;
+    return biased_ + shared - (held_? 1 : 0);
+  }
+};
+
+#ifdef THREAD_SAFE_REFCOUNTS
+typedef RcBiased RcDefaultPolicy;
+#else
+typedef RcPlain<uint32_t> RcDefaultPolicy;
+#endif
+
+template<class T, class Policy = RcDefaultPolicy>
 class RcDirectMixin;
 
 /**
   @brief Inherit from this class to make a pointer reference countable.
+  @param Policy how the references are counted, see RcPlain, RcAtomic and RcBiased
 */
-template<class T>
+template<class T, class Policy = RcDefaultPolicy>
 class RcMixin{
 private:
 
-  mutable unsigned short refcount_;
-  mutable unsigned short weakrefcount_;
+  mutable Policy refcount_;
+  mutable typename Policy::WeakPolicy weakrefcount_;
   
 protected:
 
   void incRefCount()const{
-    ++refcount_;
+    refcount_.inc();
     #ifdef PRINT_REFCOUNTS
-    fprintf(stderr, "incRefCount: %p -> %d\n", this, refcount_);
+    fprintf(stderr, "incRefCount: %p -> %zu\n", this, (size_t)refcount_.get());
     #endif
   }
+  /*
+    Takes a reference unless the count has already dropped to zero, in which case
+    the object is being released and must not be used.
+  */
+  bool tryIncRefCount()const{
+    bool ret = refcount_.tryInc();
+    #ifdef PRINT_REFCOUNTS
+    fprintf(stderr, "tryIncRefCount: %p -> %zu\n", this, (size_t)refcount_.get());
+    #endif
+    return ret;
+  }
   void decRefCount()const{
-    --refcount_;
+    bool released = refcount_.dec();
     #ifdef PRINT_REFCOUNTS
-    fprintf(stderr, "decRefCount: %p -> %d\n", this, refcount_);
+    fprintf(stderr, "decRefCount: %p -> %zu\n", this, (size_t)refcount_.get());
     #endif
-    if(refcount_ == 0){
+    if(released){
       static_cast<const T*>(this)->~T();
-      if(weakrefcount_ == 0){
+      if(weakrefcount_.get() == 0){
         T::operator delete(
           const_cast<typename std::remove_const<T>::type*>(
             static_cast<const T*>(this)
@@ -54,17 +212,17 @@ protected:
   }
   
   void incWeakRefCount()const{
-    ++weakrefcount_;
+    weakrefcount_.inc();
     #ifdef PRINT_REFCOUNTS
-    fprintf(stderr, "incWeakRefCount: %p -> %d\n", this, weakrefcount_);
+    fprintf(stderr, "incWeakRefCount: %p -> %zu\n", this, (size_t)weakrefcount_.get());
     #endif
   }
   void decWeakRefCount()const{
-    --weakrefcount_;
+    bool released = weakrefcount_.dec();
     #ifdef PRINT_REFCOUNTS
-    fprintf(stderr, "decWeakRefCount: %p -> %d\n", this, weakrefcount_);
+    fprintf(stderr, "decWeakRefCount: %p -> %zu\n", this, (size_t)weakrefcount_.get());
     #endif
-    if(refcount_ + weakrefcount_ == 0){
+    if(released && refcount_.get() == 0){
       T::operator delete(
         const_cast<typename std::remove_const<T>::type*>(
           static_cast<const T*>(this)
@@ -76,12 +234,12 @@ protected:
 public:
   
   void operator=(const RcMixin&){
-    refcount_ = 0;
-    weakrefcount_ = 0;
+    refcount_.reset();
+    weakrefcount_.reset();
   }
 
-  unsigned short getRefCount()const{return refcount_;}
-  unsigned short getWeakRefCount()const{return weakrefcount_;}
+  size_t getRefCount()const{return refcount_.get();}
+  size_t getWeakRefCount()const{return weakrefcount_.get();}
   
   template<class Y>
   friend class rc_ptr;
@@ -90,20 +248,21 @@ public:
   
 private:
   
-  RcMixin(): refcount_(0), weakrefcount_(0){}
-  RcMixin(const RcMixin&): refcount_(0), weakrefcount_(0){}
+  RcMixin(){}
+  RcMixin(const RcMixin&){}
   
   friend T;
-  friend RcDirectMixin<T>;
+  friend RcDirectMixin<T, Policy>;
 };
 
-template<class T>
-class RcDirectMixin: public RcMixin<T>{
+template<class T, class Policy>
+class RcDirectMixin: public RcMixin<T, Policy>{
 public:
-  using RcMixin<T>::incRefCount;
-  using RcMixin<T>::decRefCount;
-  using RcMixin<T>::incWeakRefCount;
-  using RcMixin<T>::decWeakRefCount;
+  using RcMixin<T, Policy>::incRefCount;
+  using RcMixin<T, Policy>::decRefCount;
+  using RcMixin<T, Policy>::tryIncRefCount;
+  using RcMixin<T, Policy>::incWeakRefCount;
+  using RcMixin<T, Policy>::decWeakRefCount;
   
 private:
   
@@ -245,14 +404,14 @@ public:
     @brief Gets the reference count.
     @return The reference count of the pointed-to object or 0 if the pointer is null.
   */
-  unsigned short getRefCount()
+  size_t getRefCount()
   {if(ptr_) return ptr_->getRefCount(); else return 0;}
   /**
     @brief Gets the weak reference count.
     @return The weak reference count of the pointed-to object or 0 if the pointer is
     null.
   */
-  unsigned short getWeakRefCount()
+  size_t getWeakRefCount()
   {if(ptr_) return ptr_->getWeakRefCount(); else return 0;}
 };
 
@@ -387,14 +546,14 @@ public:
     @brief Gets the reference count.
     @return The reference count of the pointed-to object or 0 if the pointer is null.
   */
-  unsigned short getRefCount()
+  size_t getRefCount()
   {if(ptr_) return ptr_->getRefCount(); else return 0;}
   /**
     @brief Gets the weak reference count.
     @return The weak reference count of the pointed-to object or 0 if the pointer is
     null.
   */
-  unsigned short getWeakRefCount()
+  size_t getWeakRefCount()
   {if(ptr_) return ptr_->getWeakRefCount(); else return 0;}
   /**
     @brief Checks if the pointed to object has expired.
@@ -1,10 +1,20 @@
 #include "string.h"
+#include "object_pools.h"
 
 #include <unordered_set>
+#include <vector>
+#include <mutex>
 
 #include <cstring>
+#include <cctype>
+#include <algorithm>
+#include <charconv>
 #include <cassert>
 
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+
 #ifndef NDEBUG
 #include "alloc_monitor.h"
 #include <cstdio>
@@ -14,221 +24,646 @@
 
 namespace{
   
-  std::unordered_set<
-    String*,
-    ptr_hash<String*>,
-    ptr_equal_to<String*>
-  > global_string_table_;
+  /*
+    The global string table is split into shards by the high bits of the string
+    hash, each with its own lock, so VMs on different threads rarely contend when
+    interning.
+  */
+  struct alignas(64) StringTableShard_{
+    std::mutex mutex;
+    std::unordered_set<
+      String*,
+      ptr_hash<String*>,
+      ptr_equal_to<String*>
+    > strings;
+  };
+  
+  constexpr int StringTableShardBits_ = 6;
+  StringTableShard_ global_string_table_[1 << StringTableShardBits_];
+  
+  inline StringTableShard_& shardOf_(const String* str){
+    return global_string_table_[
+      str->hash() >> (sizeof(size_t) * 8 - StringTableShardBits_)
+    ];
+  }
   
+  /*
+    A string released while another thread interned an equal one may already have
+    been replaced in the table, or its replacement released in turn, see
+    String::intern.
+  */
   inline void popGlobalString_(String* str){
-    auto res = global_string_table_.erase(str);
-    assert(res == 1);
+    auto& shard = shardOf_(str);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.strings.find(str);
+    if(it != shard.strings.end() && *it == str) shard.strings.erase(it);
   }
-  inline String* pushGlobalString_(String* str){
-    auto ins = global_string_table_.insert(str);
-    if(ins.second){
-      return str;
+  
+  bool isAscii_(const char* str, int len){
+    int i = 0;
+  #if defined(__x86_64__)
+    __m128i acc = _mm_setzero_si128();
+    for(; i + 16 <= len; i += 16){
+      acc = _mm_or_si128(acc, _mm_loadu_si128(reinterpret_cast<const __m128i*>(str + i)));
+    }
+    if(_mm_movemask_epi8(acc) != 0) return false;
+  #else
+    uint64_t acc = 0;
+    for(; i + 8 <= len; i += 8){
+      uint64_t word;
+      memcpy(&word, str + i, 8);
+      acc |= word;
+    }
+    if((acc & 0x8080808080808080ull) != 0) return false;
+  #endif
+    for(; i < len; ++i){
+      if((str[i] & 0x80) != 0) return false;
+    }
+    return true;
+  }
+  
+  //buffers of builders and flattened strings, small ones are pooled
+  inline char* allocateBuffer_(int size){
+    if(size <= (int)ObjectPools::MaxCellSize){
+      return static_cast<char*>(ObjectPools::allocate(size));
+    }
+    return new char[size];
+  }
+  inline void deallocateBuffer_(const char* buffer, int size){
+    if(size <= (int)ObjectPools::MaxCellSize){
+      ObjectPools::deallocate(const_cast<char*>(buffer));
     }else{
-      //warning: string deallocated without call to destructor.
-      ::operator delete(str);
-      return *ins.first;
+      delete[] buffer;
     }
   }
   
+  /*
+    The characters of a string follow it in its cell, unless that would not fit in a
+    pool cell. Then the string keeps them in a buffer of its own.
+  */
+  inline bool fitsInline_(int len){
+    return sizeof(String) + len + 1 <= ObjectPools::MaxCellSize;
+  }
+  inline size_t cellSize_(int len){
+    return fitsInline_(len)? sizeof(String) + len + 1 : sizeof(String);
+  }
+  
+  inline bool isUtf8Lead_(char c){
+    return (c & 0xc0) != 0x80;
+  }
+  
+  String* makePinned_(const char* str, int len){
+    return make_new<String>(str, len)->intern();
+  }
+  
+  String* const* asciiStrings_(){
+    static String* const* strings = []{
+      String** ret = new String*[128];
+      for(int i = 0; i < 128; ++i){
+        char c = i;
+        ret[i] = makePinned_(&c, 1);
+      }
+      return ret;
+    }();
+    return strings;
+  }
+  
+  String* const* smallIntStrings_(){
+    static String* const* strings = []{
+      String** ret = new String*[String::SmallInts];
+      for(int i = 0; i < String::SmallInts; ++i){
+        char buffer[16];
+        ret[i] = makePinned_(buffer, std::to_chars(buffer, buffer + 16, i).ptr - buffer);
+      }
+      return ret;
+    }();
+    return strings;
+  }
+  
+  inline int writeSmallInt_(char* buffer, int64_t val){
+    const String* str = String::smallInt(val);
+    memcpy(buffer, str->data(), str->len());
+    return str->len();
+  }
+  
+  // large enough for any number written by writeNumToBuffer_
+  constexpr int NumBufferSize_ = 32;
+  
+  /*
+    Numbers are formatted and parsed with charconv, which is independent of the
+    locale. Floats are formatted like printf's %g.
+  */
   inline int writeNumToBuffer_(char* buffer, bool val){
-    return sprintf(buffer, "%s", val? "true" : "false");
+    if(val){
+      memcpy(buffer, "true", 4);
+      return 4;
+    }else{
+      memcpy(buffer, "false", 5);
+      return 5;
+    }
   }
   inline int writeNumToBuffer_(char* buffer, int32_t val){
-    return sprintf(buffer, "%d", val);
+    if(val >= 0 && val < String::SmallInts) return writeSmallInt_(buffer, val);
+    return std::to_chars(buffer, buffer + NumBufferSize_, val).ptr - buffer;
   }
   inline int writeNumToBuffer_(char* buffer, int64_t val){
-    return sprintf(buffer, "%lld", val);
+    if(val >= 0 && val < String::SmallInts) return writeSmallInt_(buffer, val);
+    return std::to_chars(buffer, buffer + NumBufferSize_, val).ptr - buffer;
   }
   inline int writeNumToBuffer_(char* buffer, float val){
-    return sprintf(buffer, "%g", (double)val);
+    return std::to_chars(
+      buffer, buffer + NumBufferSize_, val, std::chars_format::general, 6
+    ).ptr - buffer;
   }
   inline int writeNumToBuffer_(char* buffer, double val){
-    return sprintf(buffer, "%g", val);
+    return std::to_chars(
+      buffer, buffer + NumBufferSize_, val, std::chars_format::general, 6
+    ).ptr - buffer;
+  }
+  
+  /*
+    Like scanf, leading whitespace and a plus sign are skipped, and anything after
+    the number is ignored.
+  */
+  template<class T>
+  bool parseNum_(const char* begin, const char* end, T* t){
+    while(begin < end && isspace(static_cast<unsigned char>(*begin))) ++begin;
+    if(end - begin > 1 && begin[0] == '+' && begin[1] != '-') ++begin;
+    return std::from_chars(begin, end, *t).ec == std::errc();
   }
   
   template<class T>
   String* makeStringFromNum_(T val){
-    char buffer[32];
+    char buffer[NumBufferSize_];
     int len = writeNumToBuffer_(buffer, val);
     return make_new<String>(const_cast<const char*>(buffer), len);
   }
   
   template<class T>
   String* addNumToString_(T val, const String* st){
-    char buffer[32];
+    char buffer[NumBufferSize_];
     int len = writeNumToBuffer_(buffer, val);
     return make_new<String>(const_cast<const char*>(buffer), len, st);
   }
   template<class T>
   String* addNumToString_(const String* st, T val){
-    char buffer[32];
+    char buffer[NumBufferSize_];
     int len = writeNumToBuffer_(buffer, val);
     return make_new<String>(st, const_cast<const char*>(buffer), len);
   }
 }
 
-String::String(): len_(0){
+char* String::initData_(int len){
+  return fitsInline_(len)? this->mut_str_() : allocateBuffer_(len + 1);
+}
+String::Kind_ String::initKind_(int len){
+  return fitsInline_(len)? Kind_::Inline : Kind_::Heap;
+}
+
+String::String()
+: len_(0), data_(mut_str_()), kind_(Kind_::Inline), hashed_(false), interned_(false),
+  ascii_(true), glyphs_(-1), utf8_index_(nullptr){
   this->mut_str_()[0] = '\0';
-  this->hash_ = this->hash();
 }
 
 String::String(const char* str, int l)
-: len_(l){
-  memcpy(this->mut_str_(), str, l);
-  this->mut_str_()[l] = '\0';
-  this->hash_ = this->hash();
+: len_(l), data_(initData_(l)), capacity_(l), kind_(initKind_(l)),
+  hashed_(false), interned_(false), ascii_(isAscii_(str, l)),
+  glyphs_(-1), utf8_index_(nullptr){
+  char* data = const_cast<char*>(this->data_);
+  memcpy(data, str, l);
+  data[l] = '\0';
 }
 
 String::String(const String* l, const String* r)
-: len_(l->len() + r->len()){
-  memcpy(this->mut_str_(), l->str(), l->len());
-  memcpy(this->mut_str_() + l->len(), r->str(), r->len());
-  this->mut_str_()[this->len_] = '\0';
-  this->hash_ = this->hash();
+: len_(l->len() + r->len()), data_(initData_(len_)), capacity_(len_),
+  kind_(initKind_(len_)), hashed_(false), interned_(false),
+  ascii_(l->ascii_ && r->ascii_), glyphs_(-1), utf8_index_(nullptr){
+  char* data = const_cast<char*>(this->data_);
+  memcpy(data, l->data(), l->len());
+  memcpy(data + l->len(), r->data(), r->len());
+  data[this->len_] = '\0';
 }
 
 String::String(const String* st, const char* cs, int csl)
-: len_(st->len() + csl){
-  memcpy(this->mut_str_(), st->str(), st->len());
-  memcpy(this->mut_str_() + st->len(), cs, csl);
-  this->mut_str_()[this->len_] = '\0';
-  this->hash_ = this->hash();
+: len_(st->len() + csl), data_(initData_(len_)), capacity_(len_),
+  kind_(initKind_(len_)), hashed_(false), interned_(false),
+  ascii_(st->ascii_ && isAscii_(cs, csl)), glyphs_(-1), utf8_index_(nullptr){
+  char* data = const_cast<char*>(this->data_);
+  memcpy(data, st->data(), st->len());
+  memcpy(data + st->len(), cs, csl);
+  data[this->len_] = '\0';
 }
 
 String::String(const char* cs, int csl, const String* st)
-: len_(st->len() + csl){
-  memcpy(this->mut_str_(), cs, csl);
-  memcpy(this->mut_str_() + csl, st->str(), st->len());
-  this->mut_str_()[this->len_] = '\0';
-  this->hash_ = this->hash();
+: len_(st->len() + csl), data_(initData_(len_)), capacity_(len_),
+  kind_(initKind_(len_)), hashed_(false), interned_(false),
+  ascii_(st->ascii_ && isAscii_(cs, csl)), glyphs_(-1), utf8_index_(nullptr){
+  char* data = const_cast<char*>(this->data_);
+  memcpy(data, cs, csl);
+  memcpy(data + csl, st->data(), st->len());
+  data[this->len_] = '\0';
+}
+
+String::String(const String* parent, const char* begin, const char* end)
+: len_(end - begin), data_(begin), parent_(parent), kind_(Kind_::View),
+  hashed_(false), interned_(false), ascii_(parent->ascii_ || isAscii_(begin, end - begin)),
+  glyphs_(-1), utf8_index_(nullptr){
+  parent->incRefCount();
+}
+
+String::String(char* buffer, int len, int capacity)
+: len_(len), data_(buffer), capacity_(capacity), kind_(Kind_::Heap),
+  hashed_(false), interned_(false), ascii_(isAscii_(buffer, len)),
+  glyphs_(-1), utf8_index_(nullptr){}
+
+String::~String(){
+  if(this->interned_) popGlobalString_(this);
+  delete[] this->utf8_index_;
+  switch(this->kind_){
+  case Kind_::View:
+    this->parent_->decRefCount();
+    break;
+  case Kind_::Heap:
+    deallocateBuffer_(this->data_, this->capacity_ + 1);
+    break;
+  case Kind_::Rope:
+    this->parent_->decRefCount();
+    this->right_->decRefCount();
+    break;
+  default:
+    break;
+  }
+}
+
+String::String(const String* left, const String* right, int depth)
+: len_(left->len() + right->len()), data_(nullptr), parent_(left), right_(right),
+  kind_(Kind_::Rope), depth_(depth), hashed_(false), interned_(false),
+  ascii_(left->ascii_ && right->ascii_), glyphs_(-1), utf8_index_(nullptr){
+  left->incRefCount();
+  right->incRefCount();
+}
+
+char* String::write(char* dest)const{
+  std::vector<const String*> stack = {this};
+  while(!stack.empty()){
+    const String* node = stack.back();
+    stack.pop_back();
+    if(node->kind_ == Kind_::Rope){
+      stack.push_back(node->right_);
+      stack.push_back(node->parent_);
+    }else{
+      memcpy(dest, node->data_, node->len_);
+      dest += node->len_;
+    }
+  }
+  return dest;
+}
+
+void String::flatten_()const{
+  char* buffer = allocateBuffer_(this->len_ + 1);
+  *this->write(buffer) = '\0';
+  this->parent_->decRefCount();
+  this->right_->decRefCount();
+  this->data_ = buffer;
+  this->kind_ = Kind_::Heap;
+  this->capacity_ = this->len_;
+}
+
+String* String::append(const String* other){
+  if(!this->isUnique() && this->len_ + other->len_ >= MinRopeLen){
+    int depth = std::max(
+      this->kind_ == Kind_::Rope? this->depth_ : 0,
+      other->kind_ == Kind_::Rope? other->depth_ : 0
+    ) + 1;
+    void* mem = ObjectPools::allocate(sizeof(String));
+    String* ret = ::new(mem) String(this, other, depth);
+    // deep ropes are flattened to bound the recursion when they are released
+    if(depth > MaxRopeDepth_) ret->flatten_();
+    return ret;
+  }
+  return this->append(other->data(), other->len());
+}
+
+void String::materialize_()const{
+  char* buffer = allocateBuffer_(this->len_ + 1);
+  memcpy(buffer, this->data_, this->len_);
+  buffer[this->len_] = '\0';
+  this->parent_->decRefCount();
+  this->data_ = buffer;
+  this->kind_ = Kind_::Heap;
+  this->capacity_ = this->len_;
+}
+
+String* String::makeBuilder_(
+  const char* a, int alen, const char* b, int blen, int capacity
+){
+  int len = alen + blen;
+  char* buffer = allocateBuffer_(capacity + 1);
+  memcpy(buffer, a, alen);
+  memcpy(buffer + alen, b, blen);
+  buffer[len] = '\0';
+  
+  void* mem = ObjectPools::allocate(sizeof(String));
+  return ::new(mem) String(buffer, len, capacity);
+}
+
+void String::reserve_(int new_len){
+  if(new_len <= this->capacity_) return;
+  char* buffer = allocateBuffer_(2 * new_len + 1);
+  memcpy(buffer, this->data_, this->len_);
+  deallocateBuffer_(this->data_, this->capacity_ + 1);
+  this->data_ = buffer;
+  this->capacity_ = 2 * new_len;
+}
+
+void String::appended_(int len, bool ascii){
+  this->len_ += len;
+  const_cast<char*>(this->data_)[this->len_] = '\0';
+  this->hashed_ = false;
+  this->ascii_ = this->ascii_ && ascii;
+  this->glyphs_ = -1;
+  delete[] this->utf8_index_;
+  this->utf8_index_ = nullptr;
+}
+
+//unique builders are formatted into directly
+template<class T>
+String* String::appendNum_(T val){
+  if(!this->isUnique() || this->kind_ != Kind_::Heap){
+    char buffer[NumBufferSize_];
+    int len = writeNumToBuffer_(buffer, val);
+    return this->append(const_cast<const char*>(buffer), len);
+  }
+  this->reserve_(this->len_ + NumBufferSize_);
+  this->appended_(writeNumToBuffer_(const_cast<char*>(this->data_) + this->len_, val), true);
+  return this;
+}
+
+String* String::append(bool val){
+  return this->appendNum_(val);
+}
+String* String::append(int32_t val){
+  return this->appendNum_(val);
+}
+String* String::append(int64_t val){
+  return this->appendNum_(val);
+}
+String* String::append(float val){
+  return this->appendNum_(val);
+}
+String* String::append(double val){
+  return this->appendNum_(val);
+}
+
+String* String::append(const char* str, int len){
+  if(!this->isUnique()){
+    return makeBuilder_(this->data(), this->len_, str, len, this->len_ + len);
+  }else if(this->kind_ != Kind_::Heap){
+    return makeBuilder_(this->data(), this->len_, str, len, 2 * (this->len_ + len));
+  }
+  
+  this->reserve_(this->len_ + len);
+  memcpy(const_cast<char*>(this->data_) + this->len_, str, len);
+  this->appended_(len, this->ascii_ && isAscii_(str, len));
+  return this;
+}
+
+void String::prepareShared_(){
+  //materializing may release the parent, which needs the lock if it is interned
+  if(this->kind_ == Kind_::View) this->materialize_();
+  this->hash();
+  if(!this->ascii_ && this->glyphs_ < 0) this->buildUtf8Index_();
+}
+
+String* String::intern(){
+  if(this->interned_){
+    this->incRefCount();
+    return this;
+  }
+  this->prepareShared_();
+  auto& shard = shardOf_(this);
+  String* found;
+  {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto ins = shard.strings.insert(this);
+    found = *ins.first;
+    if(!ins.second && !found->tryIncRefCount()){
+      //the string found is being released, this one takes its place
+      shard.strings.erase(ins.first);
+      ins = shard.strings.insert(this);
+    }
+    if(ins.second){
+      this->interned_ = true;
+      this->incRefCount();
+      return this;
+    }
+  }
+  if(this->getRefCount() == 0){
+    this->~String();
+    String::operator delete(this);
+  }
+  return found;
+}
+
+String* String::findInterned()const{
+  if(this->interned_){
+    this->incRefCount();
+    return const_cast<String*>(this);
+  }
+  auto& shard = shardOf_(this);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  auto it = shard.strings.find(const_cast<String*>(this));
+  return it != shard.strings.end() && (*it)->tryIncRefCount()? *it : nullptr;
+}
+
+String* String::slice(int begin, int end)const{
+  int len = end - begin;
+  this->data();
+  const String* root = this->kind_ == Kind_::View? this->parent_ : this;
+  if(len >= MinViewLen && len * 4 >= root->len_){
+    void* mem = ObjectPools::allocate(sizeof(String));
+    return ::new(mem) String(root, this->data() + begin, this->data() + end);
+  }else{
+    return make_new<String>(this->data() + begin, len);
+  }
 }
 
 int String::cmp(const String& other)const{
-  return this->cmp(other.str());
+  return cmp(this->data(), this->len_, other.data(), other.len_);
+}
+int String::cmp(const char* lhs, int lhs_len, const char* rhs, int rhs_len){
+  //memcmp only gives the sign of the difference, so it is used to skip the common
+  //prefix a word at a time, and the first differing byte is subtracted directly.
+  int len = std::min(lhs_len, rhs_len);
+  int i = 0;
+  for(; i + 8 <= len; i += 8){
+    if(memcmp(lhs + i, rhs + i, 8) != 0) break;
+  }
+  for(; i < len; ++i){
+    int diff = lhs[i] - rhs[i];
+    if(diff != 0) return diff;
+  }
+  return lhs_len - rhs_len;
 }
 int String::cmp(const char* other)const{
-  //strcmp is not used here, since the behaviour of strcmp is not standardized.
-  //in particular the implementation used in valgrind returns a value in the
-  //range [-1;+1].
-  const char* this_str = this->str();
-  for(int i = 0;; ++i){
+  const char* this_str = this->data();
+  for(int i = 0; i < this->len_; ++i){
     int diff = this_str[i] - other[i];
-    if(diff != 0 || this_str[i] == 0) return diff;
+    if(diff != 0) return diff;
   }
+  return -other[this->len_];
+}
+
+bool String::contentEquals_(const String& other)const{
+  if(this->len_ != other.len_) return false;
+  if(this->hashed_ && other.hashed_ && this->hash_ != other.hash_) return false;
+  return memcmp(this->data(), other.data(), this->len_) == 0;
 }
 
 size_t String::hash()const{
-  return defaultHash(this->str(), this->str() + this->len_);
+  if(!this->hashed_){
+    this->hash_ = defaultHash(this->data(), this->data() + this->len_);
+    this->hashed_ = true;
+  }
+  return this->hash_;
 }
 
 bool String::toInt32(int32_t* t){
-  return sscanf(this->str(), "%d", t) == 1;
+  return parseNum_(this->data(), this->data() + this->len_, t);
 }
 bool String::toInt64(int64_t* t){
-  return sscanf(this->str(), "%lld", t) == 1;
+  return parseNum_(this->data(), this->data() + this->len_, t);
 }
 bool String::toFloat(float* t){
-  return sscanf(this->str(), "%f", t) == 1;
+  return parseNum_(this->data(), this->data() + this->len_, t);
 }
 bool String::toDouble(double* t){
-  return sscanf(this->str(), "%lf", t) == 1;
+  return parseNum_(this->data(), this->data() + this->len_, t);
 }
 
-int String::utf8Len()const{
-  int len = 0;
-  for(const char* p = this->str(); *p != '\0'; ++p){
-    if((*p & 0x80) == 0) ++len;
+void String::buildUtf8Index_()const{
+  const char* p = this->data();
+  int glyphs = 0;
+  std::vector<int> index;
+  for(int i = 0; i < this->len_; ++i){
+    if(isUtf8Lead_(p[i])){
+      if(glyphs % Utf8Stride == 0) index.push_back(i);
+      ++glyphs;
+    }
+  }
+  this->glyphs_ = glyphs;
+  //short strings are scanned from the start instead
+  if(index.size() > 1){
+    this->utf8_index_ = new int[index.size()];
+    std::copy(index.begin(), index.end(), this->utf8_index_);
   }
-  return len;
+}
+
+int String::utf8Len()const{
+  if(this->ascii_) return this->len_;
+  if(this->glyphs_ < 0) this->buildUtf8Index_();
+  return this->glyphs_;
 }
 
 uint32_t String::utf8Get(unsigned utf8_idx)const{
   auto idx = this->utf82Idx(utf8_idx);
-  if(idx < 0) return 0xffffffff;
+  if(idx < 0 || idx >= this->len_) return 0xffffffff;
   else return this->getGlyph(idx);
 }
 
 int String::utf82Idx(unsigned i)const{
-  int ret = 0;
-  const char* p = this->str();
+  if(this->ascii_) return i <= (unsigned)this->len_? (int)i : -1;
+  
+  int glyphs = this->utf8Len();
+  if(i >= (unsigned)glyphs) return i == (unsigned)glyphs? this->len_ : -1;
   
+  const char* p = this->data();
+  int ret = 0;
+  if(this->utf8_index_){
+    ret = this->utf8_index_[i / Utf8Stride];
+    i %= Utf8Stride;
+  }else{
+    while(!isUtf8Lead_(p[ret])) ++ret;
+  }
   for(; i > 0; --i){
-    if(p[ret] == 0x00) return -1;
-    while((p[ret] & 0x80) != 0) ++ret;
     ++ret;
+    while(ret < this->len_ && !isUtf8Lead_(p[ret])) ++ret;
   }
-  
   return ret;
 }
 
 uint32_t String::getGlyph(unsigned idx)const{
-  uint32_t ret = 0;
-  const char* p = this->str() + idx;
-  for(int i = 0; i < 4; ++i){
-    ret <<= 8;
-    ret |= p[i];
-    if((ret & 0x80) == 0) break;
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(this->data()) + idx;
+  int len = p[0] < 0xc0? 1 : p[0] < 0xe0? 2 : p[0] < 0xf0? 3 : 4;
+  len = std::min(len, this->len_ - (int)idx);
+  uint32_t ret = p[0];
+  for(int i = 1; i < len && !isUtf8Lead_(p[i]); ++i){
+    ret = (ret << 8) | p[i];
   }
   return ret;
 }
 
+String* String::ascii(char c){
+  return asciiStrings_()[c & 0x7f];
+}
+
+String* String::smallInt(int64_t val){
+  if(val < 0 || val >= SmallInts) return nullptr;
+  return smallIntStrings_()[val];
+}
+
 void String::operator delete(void* ptr){
-  popGlobalString_(reinterpret_cast<String*>(ptr));
-  ::operator delete(ptr);
+  ObjectPools::deallocate(ptr);
 }
 
 template<>
 String* make_new<String>(){
-  void* mem = ::operator new(1 + sizeof(String));
-  return pushGlobalString_(::new(mem) String());
+  void* mem = ObjectPools::allocate(1 + sizeof(String));
+  return ::new(mem) String();
 }
 
 template<>
 String* make_new<String, const char*>(const char* str){
   int len = strlen(str);
-  void* mem = ::operator new(len + 1 + sizeof(String));
-  return pushGlobalString_(::new(mem) String(str, len));
+  void* mem = ObjectPools::allocate(cellSize_(len));
+  return ::new(mem) String(str, len);
 }
 
 template<>
 String* make_new<String, const char*, int>(const char* str, int len){
-  void* mem = ::operator new(len + 1 + sizeof(String));
-  return pushGlobalString_(::new(mem) String(str, len));
+  void* mem = ObjectPools::allocate(cellSize_(len));
+  return ::new(mem) String(str, len);
 }
 
 template<>
 String* make_new<String, const char*, const char*>(const char* begin, const char* end){
   int len = end - begin;
-  void* mem = ::operator new(len + 1 + sizeof(String));
-  return pushGlobalString_(::new(mem) String(begin, len));
+  void* mem = ObjectPools::allocate(cellSize_(len));
+  return ::new(mem) String(begin, len);
 }
 
 template<>
 String* make_new<String, const String*, const String*>(const String* l, const String* r){
   int len = l->len() + r->len();
-  void* mem = ::operator new(len + 1 + sizeof(String));
-  return pushGlobalString_(::new(mem) String(l, r));
+  void* mem = ObjectPools::allocate(cellSize_(len));
+  return ::new(mem) String(l, r);
 }
 
 template<>
 String* make_new<String, const char*, int, const String*>
 (const char* cs, int csl, const String* st){
   int len = csl + st->len();
-  void* mem = ::operator new(len + 1 + sizeof(String));
-  return pushGlobalString_(::new(mem) String(cs, csl, st));
+  void* mem = ObjectPools::allocate(cellSize_(len));
+  return ::new(mem) String(cs, csl, st);
 }
 
 template<>
 String* make_new<String, const String*, const char*, int>
 (const String* st, const char* cs, int csl){
   int len = csl + st->len();
-  void* mem = ::operator new(len + 1 + sizeof(String));
-  return pushGlobalString_(::new(mem) String(st, cs, csl));
+  void* mem = ObjectPools::allocate(cellSize_(len));
+  return ::new(mem) String(st, cs, csl);
 }
 
 //numeral conversions
@@ -251,17 +686,17 @@ template<> String* make_new<String, double>(double val){
 //single glyph
 template<> String* make_new<String, uint32_t>(uint32_t val){
   int len = 4;
-  while(val & 0xff000000 == 0){
+  while(len > 0 && (val & 0xff000000) == 0){
     val <<= 8;
     --len;
   }
   char buffer[4];
-  for(int i = 3; i >= 0; --i){
-    buffer[i] = (val >> (8 * i)) & 0xff;
+  for(int i = 0; i < len; ++i){
+    buffer[i] = (val >> (24 - 8 * i)) & 0xff;
   }
   
-  void* mem = ::operator new(len + 1 + sizeof(String));
-  return pushGlobalString_(::new(mem) String(buffer, len));
+  void* mem = ObjectPools::allocate(cellSize_(len));
+  return ::new(mem) String(buffer, len);
 }
 
 //numeral additions
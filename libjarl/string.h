@@ -13,15 +13,36 @@
 #endif
 
 /*
-  An immutable string allocated in a single buffer.
+  An immutable string.
   This object is actually just the header of a dynamically allocated block of memory.
   This object must be allocated using the make_new template specialization.
   For this reason creating objects of this class is disabled using any other method.
   Copying and moving is also disabled.
   
-  All strings are stored in a global string table after being allocated. Strings
-  which are not stored in this table upon allocation will be deallocated.
-  *THIS DEALLOCATION TAKES PLACE WITHOUT CALLING THE STRING DESTRUCTOR*.
+  Strings are usually stored inline in the block, following the header. A string
+  created by slicing may instead be a view into the characters of a parent string,
+  which it keeps alive. Views are not nul terminated, data() and len() should be
+  preferred over str(), which copies the characters out of the parent on first use.
+  
+  Strings produced by appending are builders, which keep their characters in a
+  separate buffer. A builder that is not shared is appended to in place, growing
+  its buffer geometrically, see append(). Appending a long string to a shared one
+  instead creates a rope, which refers to both halves and is flattened into a
+  single buffer on first access to its characters. write() copies out the
+  characters of a rope without flattening it.
+  
+  Whether a string is pure ASCII is recorded when it is created, and glyphs of
+  ASCII strings are indexed directly. Other strings build an index of the byte
+  offset of every Utf8Stride-th glyph on first use, so a glyph is found by scanning
+  at most Utf8Stride glyphs from the nearest checkpoint.
+  
+  Strings are not interned when they are created. Literals and table keys are added
+  to a global string table with intern(), where equal strings are the same object,
+  so interned strings compare by pointer. Other strings compare by content. The hash
+  of a string is computed on first use. The string table may be used from several
+  threads at once. Since other threads may find an interned string in the table,
+  its hash, characters and utf-8 index are all computed before it is added, and it
+  is not modified after.
 */
 
 #ifndef NDEBUG
@@ -36,24 +57,94 @@ class String:
 , public MonitoredMixin<String, string_alloc_monitor>
 #endif
 {
+  enum class Kind_: unsigned char{
+    Inline,
+    View,
+    Heap,
+    Rope
+  };
+  
   int len_;
-  //the hash_ value should be initialized in every constructor, since it is used
-  //by std::hash.
-  size_t hash_;
+  //the hash is computed on first use when hashed_ is not set.
+  mutable size_t hash_;
+  mutable const char* data_;
+  //the parent of a view, or the left half of a rope
+  mutable const String* parent_;
+  mutable const String* right_;
+  mutable int capacity_;
+  mutable Kind_ kind_;
+  unsigned char depth_;
+  mutable bool hashed_;
+  bool interned_;
+  bool ascii_;
+  //number of glyphs, -1 until counted. Unused for ascii strings.
+  mutable int glyphs_;
+  //byte offsets of every Utf8Stride-th glyph, built on first use
+  mutable int* utf8_index_;
   
   char* mut_str_(){return reinterpret_cast<char*>(this) + sizeof(String);}
+  char* initData_(int len);
+  static Kind_ initKind_(int len);
   
   String();
   String(const char* str, int l);
   String(const String* l, const String* r);
   String(const String*, const char*, int);
   String(const char*, int, const String*);
+  String(const String* parent, const char* begin, const char* end);
+  String(char* buffer, int len, int capacity);
+  String(const String* left, const String* right, int depth);
+  
+  static constexpr int MaxRopeDepth_ = 64;
+  
+  void materialize_()const;
+  void flatten_()const;
+  bool contentEquals_(const String&)const;
+  void buildUtf8Index_()const;
+  void prepareShared_();
+  void reserve_(int);
+  void appended_(int, bool);
+  template<class T>
+  String* appendNum_(T);
+  static String* makeBuilder_(const char*, int, const char*, int, int);
   
 public:
+
+  // slices shorter than this, or much shorter than their parent, are copied
+  static constexpr int MinViewLen = 32;
+  // shared strings are only joined by a rope if the result is at least this long
+  static constexpr int MinRopeLen = 256;
+  // distance in glyphs between the checkpoints of the utf-8 index
+  static constexpr int Utf8Stride = 64;
+  // the decimal forms of the integers below this are preinterned
+  static constexpr int SmallInts = 1024;
+  
+  /*
+    Returns the preinterned string holding the single ASCII character c. The
+    preinterned strings are created on first use and never deallocated.
+  */
+  static String* ascii(char c);
+  /*
+    Returns the preinterned decimal form of val, or nullptr if val is not in
+    [0, SmallInts).
+  */
+  static String* smallInt(int64_t val);
+  
   int len()const{return len_;}
+  const char* data()const{
+    if(this->kind_ == Kind_::Rope) this->flatten_();
+    return data_;
+  }
   const char* str()const{
-    return reinterpret_cast<const char*>(this) + sizeof(String);
+    if(this->kind_ == Kind_::View) this->materialize_();
+    return this->data();
   }
+  /*
+    Copies the characters to dest, returns the end of the copied range.
+  */
+  char* write(char* dest)const;
+  
+  ~String();
   
   String(const String&) = delete;
   String(String&&) = delete;
@@ -62,22 +153,82 @@ public:
   
   int cmp(const String& other)const;
   int cmp(const char* other)const;
+  static int cmp(const char* lhs, int lhs_len, const char* rhs, int rhs_len);
   bool operator==(const String& other)const{
-    return this == &other;
+    return this == &other || (
+      !(this->interned_ && other.interned_) && this->contentEquals_(other)
+    );
   }
   bool operator!=(const String& other)const{
-    return this != &other;
+    return !(*this == other);
   }
   
   size_t hash()const;
   
+  bool isInterned()const{return interned_;}
+  bool isBuilder()const{
+    return this->kind_ == Kind_::Heap && this->capacity_ > this->len_;
+  }
+  /*
+    Returns the string from the global string table equal to this one, adding this
+    string to the table if there is none. The returned string holds a reference
+    taken for the caller, which is taken under the lock of the table, so the string
+    can not be released by another thread in between. Views are copied out of their
+    parent before being added. If an equal string is found and nothing refers to
+    this one, this string is deallocated.
+  */
+  String* intern();
+  /*
+    Like intern, but returns nullptr instead of adding to the table. Strings in the
+    table whose last reference is being released count as absent.
+  */
+  String* findInterned()const;
+  
+  /*
+    Returns the substring between the byte offsets begin and end. Long slices are
+    views into this string, short ones are copies.
+  */
+  String* slice(int begin, int end)const;
+  
+  /*
+    A string can be modified in place if nothing else refers to it. Interned strings
+    are referred to by the global string table.
+  */
+  bool isUnique()const{
+    return this->getRefCount() == 1 && !this->interned_;
+  }
+  /*
+    Returns the concatenation of this string and the argument as a builder. If this
+    string is a unique builder it is modified in place and returned.
+  */
+  String* append(const String*);
+  String* append(const char*, int);
+  String* append(bool);
+  String* append(int32_t);
+  String* append(int64_t);
+  String* append(float);
+  String* append(double);
+  
   bool toInt32(int32_t*);
   bool toInt64(int64_t*);
   bool toFloat(float*);
   bool toDouble(double*);
   
+  bool isAscii()const{return ascii_;}
+  /*
+    Returns the number of glyphs in the string.
+  */
   int utf8Len()const;
+  /*
+    Returns the byte offset of the glyph at the given index, len() for the index
+    one past the last glyph, or -1 if the index is out of range.
+  */
   int utf82Idx(unsigned)const;
+  /*
+    Returns the bytes of the glyph at the given byte offset packed into an integer,
+    first byte highest. utf8Get does the same for a glyph index, and returns
+    0xffffffff for an index out of range.
+  */
   uint32_t getGlyph(unsigned)const;
   uint32_t utf8Get(unsigned)const;
   
@@ -162,13 +313,13 @@ namespace std{
   
   template<> struct hash<String>{
     size_t operator()(const String& arg)const{
-      return arg.hash_;
+      return arg.hash();
     }
   };
   
   template<> struct equal_to<String>{
     bool operator()(const String& lhs, const String& rhs)const{
-      return lhs.cmp(rhs) == 0;
+      return lhs == rhs;
     }
   };
 }
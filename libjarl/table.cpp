@@ -1,5 +1,245 @@
 #include "table.h"
 
+#include <functional>
+
+namespace{
+  
+  // spreads the bits of the value hash, pointer hashes are zero in the low bits
+  uint64_t hashKey_(const TypedValue& key){
+    uint64_t h = std::hash<TypedValue>()(key);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+  }
+  
+  /*
+    Keys are hashed and compared by pointer, so string keys have to be interned.
+  */
+  bool isCanonicalKey_(const TypedValue& key){
+    return key.type != TypeTag::String || key.value.string_v->isInterned();
+  }
+  
+  size_t slotIndex_(uint32_t map, uint32_t bit){
+    return __builtin_popcount(map & (bit - 1));
+  }
+}
+
+Table::Node_::Node_(const Node_& other):
+  flat(other.flat),
+  datamap(other.datamap),
+  nodemap(other.nodemap),
+  entries(other.entries),
+  children(other.children){
+  for(auto child: this->children){
+    child->incRefCount();
+  }
+}
+
+Table::Node_::~Node_(){
+  for(auto child: this->children){
+    child->decRefCount();
+  }
+}
+
+Table::const_iterator::const_iterator(const Node_* root): depth_(0){
+  if(root){
+    this->stack_[0] = {root, 0};
+    this->depth_ = 1;
+    this->settle_();
+  }
+}
+
+/*
+  Moves the iterator down to the next entry, or pops it empty at the end. The
+  entries of a node are visited before its children.
+*/
+void Table::const_iterator::settle_(){
+  while(this->depth_ > 0){
+    Frame_& top = this->stack_[this->depth_ - 1];
+    size_t num_entries = top.node->entries.size();
+    if(top.pos < num_entries) return;
+    
+    size_t child = top.pos - num_entries;
+    if(child < top.node->children.size()){
+      ++top.pos;
+      this->stack_[this->depth_++] = {top.node->children[child], 0};
+    }else{
+      --this->depth_;
+    }
+  }
+}
+
+Table::Table(): root_(nullptr), size_(0){}
+
+Table::Table(const Table& other): root_(other.root_), size_(other.size_){
+  if(this->root_) this->root_->incRefCount();
+}
+
+Table::~Table(){
+  if(this->root_) this->root_->decRefCount();
+}
+
+Table::Node_* Table::unique_(Node_*& node){
+  if(node->getRefCount() > 1){
+    Node_* copy = new Node_(*node);
+    copy->incRefCount();
+    node->decRefCount();
+    node = copy;
+  }
+  return node;
+}
+
+TypedValue* Table::findOrInsert_(
+  Node_*& slot,
+  const TypedValue& key,
+  uint64_t hash,
+  unsigned shift,
+  bool* inserted
+){
+  Node_* node = unique_(slot);
+  
+  if(node->flat){
+    for(auto& entry: node->entries){
+      if(std::equal_to<TypedValue>()(entry.first, key)) return &entry.second;
+    }
+    node->entries.emplace_back(key, nullptr);
+    *inserted = true;
+    return &node->entries.back().second;
+  }
+  
+  uint32_t bit = 1u << ((hash >> shift) & 31);
+  
+  if(node->datamap & bit){
+    size_t idx = slotIndex_(node->datamap, bit);
+    if(std::equal_to<TypedValue>()(node->entries[idx].first, key)){
+      return &node->entries[idx].second;
+    }
+    
+    // two keys share the slot, push the old entry down into a new child
+    Entry old = std::move(node->entries[idx]);
+    node->entries.erase(node->entries.begin() + idx);
+    node->datamap &= ~bit;
+    
+    Node_* child = new Node_(shift + 5 >= 64);
+    child->incRefCount();
+    bool dummy;
+    *findOrInsert_(child, old.first, hashKey_(old.first), shift + 5, &dummy) =
+      std::move(old.second);
+    
+    node->nodemap |= bit;
+    idx = slotIndex_(node->nodemap, bit);
+    node->children.insert(node->children.begin() + idx, child);
+    return findOrInsert_(node->children[idx], key, hash, shift + 5, inserted);
+  }
+  
+  if(node->nodemap & bit){
+    size_t idx = slotIndex_(node->nodemap, bit);
+    return findOrInsert_(node->children[idx], key, hash, shift + 5, inserted);
+  }
+  
+  node->datamap |= bit;
+  size_t idx = slotIndex_(node->datamap, bit);
+  node->entries.emplace(node->entries.begin() + idx, key, nullptr);
+  *inserted = true;
+  return &node->entries[idx].second;
+}
+
+void Table::toTrie_(){
+  Node_* flat = this->root_;
+  Node_* trie = new Node_(false);
+  trie->incRefCount();
+  
+  bool dummy;
+  for(auto& entry: flat->entries){
+    *findOrInsert_(trie, entry.first, hashKey_(entry.first), 0, &dummy) = entry.second;
+  }
+  
+  flat->decRefCount();
+  this->root_ = trie;
+}
+
+const TypedValue* Table::find(const TypedValue& key)const{
+  if(!isCanonicalKey_(key)){
+    String* interned = key.value.string_v->findInterned();
+    if(!interned) return nullptr;
+    //if the key is found the table holds a reference to it
+    const TypedValue* ret = this->find(TypedValue(interned));
+    interned->decRefCount();
+    return ret;
+  }
+  
+  const Node_* node = this->root_;
+  if(!node) return nullptr;
+  
+  uint64_t hash = node->flat? 0 : hashKey_(key);
+  unsigned shift = 0;
+  
+  while(!node->flat){
+    uint32_t bit = 1u << ((hash >> shift) & 31);
+    if(node->datamap & bit){
+      const Entry& entry = node->entries[slotIndex_(node->datamap, bit)];
+      return std::equal_to<TypedValue>()(entry.first, key)? &entry.second : nullptr;
+    }else if(node->nodemap & bit){
+      node = node->children[slotIndex_(node->nodemap, bit)];
+      shift += 5;
+    }else return nullptr;
+  }
+  
+  for(auto& entry: node->entries){
+    if(std::equal_to<TypedValue>()(entry.first, key)) return &entry.second;
+  }
+  return nullptr;
+}
+
+TypedValue* Table::findMutable(const TypedValue& key){
+  if(!this->find(key)) return nullptr;
+  return this->findOrInsert(key);
+}
+
+TypedValue* Table::findOrInsert(const TypedValue& key, bool* inserted){
+  if(!isCanonicalKey_(key)){
+    String* interned = key.value.string_v->intern();
+    TypedValue* ret = this->findOrInsert(TypedValue(interned), inserted);
+    interned->decRefCount();
+    return ret;
+  }
+  
+  bool dummy;
+  if(!inserted) inserted = &dummy;
+  *inserted = false;
+  
+  if(!this->root_){
+    this->root_ = new Node_(true);
+    this->root_->incRefCount();
+  }else if(this->root_->flat && this->size_ >= FlatLimit && !this->find(key)){
+    this->toTrie_();
+  }
+  
+  uint64_t hash = this->root_->flat? 0 : hashKey_(key);
+  TypedValue* ret = findOrInsert_(this->root_, key, hash, 0, inserted);
+  if(*inserted) ++this->size_;
+  return ret;
+}
+
+void Table::insert(TypedValue&& key, TypedValue&& val){
+  bool inserted;
+  TypedValue* slot = this->findOrInsert(key, &inserted);
+  if(inserted) *slot = std::move(val);
+}
+
+void Table::clear(){
+  if(this->root_ && this->root_->flat && this->root_->getRefCount() == 1){
+    this->root_->entries.clear();
+  }else if(this->root_){
+    this->root_->decRefCount();
+    this->root_ = nullptr;
+  }
+  this->size_ = 0;
+}
+
 #ifndef NDEBUG
 std::string Table::toStrDebug()const{
   using namespace std::string_literals;
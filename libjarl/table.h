@@ -4,9 +4,12 @@
 #include "value.h"
 #include "misc.h"
 #include "rc_mixin.h"
+#include "object_pools.h"
 
 #include <memory>
-#include <unordered_map>
+#include <vector>
+#include <utility>
+#include <cstdint>
 
 #ifndef NDEBUG
 #include <string>
@@ -14,31 +17,142 @@
 
 class TypedValue;
 
-class Table:
-  public std::unordered_map<TypedValue, TypedValue>,
-  public RcDirectMixin<Table>
-{
+/*
+  Persistent hash table. The entries live in reference counted nodes that are
+  shared between copies of a table, so copying a table is O(1) and a write only
+  copies the nodes on the path to the modified entry.
+
+  Small tables are a single flat node searched linearly. When a table grows past
+  FlatLimit entries it is converted to a hash array mapped trie, branching on 5
+  bits of the key hash per level. Keys whose hashes collide in all bits end up
+  together in a flat node at the bottom of the trie.
+*/
+class Table: public RcDirectMixin<Table> {
 public:
-  
-  using std::unordered_map<TypedValue, TypedValue>::unordered_map;
-  
-  void operator delete(void* ptr){
-    ::operator delete(ptr);
+
+  typedef std::pair<TypedValue, TypedValue> Entry;
+
+  static constexpr size_t FlatLimit = 8;
+
+private:
+
+  struct Node_: public RcDirectMixin<Node_> {
+    bool flat;
+    uint32_t datamap;
+    uint32_t nodemap;
+    std::vector<Entry> entries;
+    std::vector<Node_*> children;
+
+    Node_(bool flat): flat(flat), datamap(0), nodemap(0){}
+    Node_(const Node_&);
+    ~Node_();
+
+    static void* operator new(size_t size){
+      return ObjectPools::allocate(size);
+    }
+    void operator delete(void* ptr){
+      ObjectPools::deallocate(ptr);
+    }
+  };
+
+  // shifts 0 to 60 in steps of 5, plus the collision node at the bottom
+  static constexpr size_t MaxDepth_ = 14;
+
+  Node_* root_;
+  size_t size_;
+
+  static Node_* unique_(Node_*&);
+  static TypedValue* findOrInsert_(Node_*&, const TypedValue&, uint64_t, unsigned, bool*);
+  void toTrie_();
+
+public:
+
+  class const_iterator{
+    struct Frame_{
+      const Node_* node;
+      size_t pos;
+    };
+    Frame_ stack_[MaxDepth_];
+    size_t depth_;
+
+    void settle_();
+
+  public:
+    const_iterator(): depth_(0){}
+    explicit const_iterator(const Node_*);
+
+    const Entry& operator*()const{
+      const Frame_& top = this->stack_[this->depth_ - 1];
+      return top.node->entries[top.pos];
+    }
+    const Entry* operator->()const{
+      return &**this;
+    }
+    const_iterator& operator++(){
+      ++this->stack_[this->depth_ - 1].pos;
+      this->settle_();
+      return *this;
+    }
+    bool operator==(const const_iterator& other)const{
+      if(this->depth_ != other.depth_) return false;
+      if(this->depth_ == 0) return true;
+      const Frame_& top = this->stack_[this->depth_ - 1];
+      const Frame_& other_top = other.stack_[other.depth_ - 1];
+      return top.node == other_top.node && top.pos == other_top.pos;
+    }
+    bool operator!=(const const_iterator& other)const{
+      return !(*this == other);
+    }
+  };
+
+  Table();
+  Table(const Table&);
+  ~Table();
+
+  void operator=(const Table&) = delete;
+
+  static void* operator new(size_t size){
+    return ObjectPools::allocate(size);
   }
-  
-  std::unordered_map<TypedValue, TypedValue>::const_iterator begin()const{
-    return this->std::unordered_map<TypedValue, TypedValue>::begin();
+  void operator delete(void* ptr){
+    ObjectPools::deallocate(ptr);
   }
-  std::unordered_map<TypedValue, TypedValue>::const_iterator end()const{
-    return this->std::unordered_map<TypedValue, TypedValue>::end();
+
+  size_t size()const{
+    return this->size_;
   }
-  std::unordered_map<TypedValue, TypedValue>::iterator begin(){
-    return this->std::unordered_map<TypedValue, TypedValue>::begin();
+
+  /*
+    Returns a pointer to the value stored at key, or nullptr if there is none.
+  */
+  const TypedValue* find(const TypedValue&)const;
+  /*
+    Like find, but the returned value may be written to. Nodes shared with other
+    tables are copied on the way down.
+  */
+  TypedValue* findMutable(const TypedValue&);
+  /*
+    Returns a writable pointer to the value stored at key. If there is no such
+    entry one is inserted holding null, and inserted is set.
+  */
+  TypedValue* findOrInsert(const TypedValue&, bool* inserted = nullptr);
+  /*
+    Inserts the entry unless the key is already present.
+  */
+  void insert(TypedValue&&, TypedValue&&);
+  /*
+    Removes all entries. A flat root that is not shared is kept, along with the
+    capacity of its entries.
+  */
+  void clear();
+
+  const_iterator begin()const{
+    return const_iterator(this->root_);
   }
-  std::unordered_map<TypedValue, TypedValue>::iterator end(){
-    return this->std::unordered_map<TypedValue, TypedValue>::end();
+  const_iterator end()const{
+    return const_iterator();
   }
-  
+
   #ifndef NDEBUG
   std::string toStrDebug()const;
   #endif
@@ -3,6 +3,7 @@
 #include "vm.h"
 #include "table.h"
 #include "iterator.h"
+#include "value_kernels.h"
 
 #include <memory>
 #include <algorithm>
@@ -11,6 +12,8 @@
 #include <cmath>
 #include <cstring>
 #include <cassert>
+#include <charconv>
+#include <limits>
 
 namespace{
   
@@ -29,6 +32,17 @@ namespace{
     }
   }
   
+  bool isAscii_(const char* str, int len){
+    return std::all_of(str, str + len, [](char c){return (c & 0x80) == 0;});
+  }
+  
+  std::unique_ptr<char[]> copyCStr_(const char* str, size_t len){
+    std::unique_ptr<char[]> ret(new char[len + 1]);
+    memcpy(ret.get(), str, len);
+    ret[len] = '\0';
+    return ret;
+  }
+  
   inline Int add_(Int a, Int b){
     return a + b;
   }
@@ -38,6 +52,196 @@ namespace{
   inline String* add_(const String* a, const String* b){
     return make_new<String>(a, b);
   }
+  
+  /*
+    Stores the result of String::append, which may be the string already held.
+  */
+  void setAppended_(TypedValue* self, String* res){
+    if(res != self->value.string_v) *self = res;
+  }
+  
+  /*
+    Replaces a string operand by its interned copy, so that it is interned once
+    and later comparisons of the value are by pointer. Builders are left alone,
+    since interning them would stop them from being appended to in place.
+  */
+  void internOperand_(TypedValue* operand){
+    String* s = operand->value.string_v;
+    if(s->isInterned() || s->isBuilder()) return;
+    s = s->intern();
+    *operand = s;
+    s->decRefCount();
+  }
+  
+  /*
+    Strings compared for equality are interned in the operands themselves.
+    Replacing a string by an equal one leaves the value unchanged, which is why
+    rhs may be written to.
+  */
+  bool stringsEqual_(TypedValue* lhs, const TypedValue* rhs){
+    internOperand_(lhs);
+    internOperand_(const_cast<TypedValue*>(rhs));
+    return *lhs->value.string_v == *rhs->value.string_v;
+  }
+  
+  using ValueKernels::ArithOp;
+  
+  void sizeError_(const char* op, size_t lhs_size, size_t rhs_size){
+    VM* vm = VM::getCurrentVM();
+    char* msg = dynSprintf(
+      "%d: Size error. Element-wise operation %s on arrays of size %d and %d.",
+      vm->getFrame()->func->getLine(vm->getFrame()->ip),
+      op,
+      (int)lhs_size,
+      (int)rhs_size
+    );
+    vm->errPrint(msg);
+    delete[] msg;
+    vm->errorJmp(1);
+  }
+  
+  /*
+    Applies an arithmetic operation where one or both of the operands are arrays.
+    Arrays are combined element by element, scalars are broadcast. Arrays of ints or
+    floats go through the vectorized kernels, everything else through op on each
+    element. A uniquely owned left hand array is updated in place.
+  */
+  void elementWise_(
+    TypedValue* self,
+    const TypedValue& other,
+    void (TypedValue::*op)(const TypedValue&),
+    ArithOp kernel_op,
+    const char* op_str
+  ){
+    if(self->type == TypeTag::Array){
+      Array* lhs = self->value.array_v;
+      size_t num = lhs->size();
+      Array* rhs = nullptr;
+      if(other.type == TypeTag::Array) rhs = other.value.array_v;
+      // checked before dst is allocated, since the error does not return
+      if(rhs && rhs->size() != num) sizeError_(op_str, num, rhs->size());
+      Array* dst = lhs->getRefCount() == 1? lhs : new Array(num);
+      
+      for(size_t i = 0; i < num;){
+        size_t run = std::min(lhs->runLength(i), dst->runLength(i));
+        if(rhs) run = std::min(run, rhs->runLength(i));
+        TypedValue* d = dst->mutableData(i);
+        const TypedValue* l = lhs->data(i);
+        
+        if(rhs){
+          const TypedValue* r = rhs->data(i);
+          if(!ValueKernels::arith(kernel_op, d, l, r, run)){
+            for(size_t j = 0; j < run; ++j){
+              if(d != l) d[j] = l[j];
+              (d[j].*op)(r[j]);
+            }
+          }
+        }else if(!ValueKernels::arithScalar(kernel_op, d, l, other, run, false)){
+          for(size_t j = 0; j < run; ++j){
+            if(d != l) d[j] = l[j];
+            (d[j].*op)(other);
+          }
+        }
+        i += run;
+      }
+      
+      if(dst != lhs) *self = dst;
+    }else{
+      Array* rhs = other.value.array_v;
+      size_t num = rhs->size();
+      Array* dst = new Array(num);
+      
+      for(size_t i = 0; i < num;){
+        size_t run = std::min(rhs->runLength(i), dst->runLength(i));
+        TypedValue* d = dst->mutableData(i);
+        const TypedValue* r = rhs->data(i);
+        if(!ValueKernels::arithScalar(kernel_op, d, r, *self, run, true)){
+          for(size_t j = 0; j < run; ++j){
+            d[j] = *self;
+            (d[j].*op)(r[j]);
+          }
+        }
+        i += run;
+      }
+      
+      *self = dst;
+    }
+  }
+  
+  CmpMode flipCmpMode_(CmpMode mode){
+    switch(mode){
+    case CmpMode::Greater:
+      return CmpMode::Less;
+    case CmpMode::Less:
+      return CmpMode::Greater;
+    case CmpMode::GreaterEqual:
+      return CmpMode::LessEqual;
+    case CmpMode::LessEqual:
+      return CmpMode::GreaterEqual;
+    default:
+      return mode;
+    }
+  }
+  
+  /*
+    Like elementWise_, for comparisons. The result is an array of bools.
+  */
+  void cmpElementWise_(TypedValue* self, const TypedValue& other, CmpMode mode){
+    if(self->type == TypeTag::Array){
+      Array* lhs = self->value.array_v;
+      size_t num = lhs->size();
+      Array* rhs = nullptr;
+      if(other.type == TypeTag::Array) rhs = other.value.array_v;
+      // checked before dst is allocated, since the error does not return
+      if(rhs && rhs->size() != num) sizeError_("comparison", num, rhs->size());
+      Array* dst = lhs->getRefCount() == 1? lhs : new Array(num);
+      
+      for(size_t i = 0; i < num;){
+        size_t run = std::min(lhs->runLength(i), dst->runLength(i));
+        if(rhs) run = std::min(run, rhs->runLength(i));
+        TypedValue* d = dst->mutableData(i);
+        const TypedValue* l = lhs->data(i);
+        
+        if(rhs){
+          const TypedValue* r = rhs->data(i);
+          if(!ValueKernels::compare(mode, d, l, r, run)){
+            for(size_t j = 0; j < run; ++j){
+              if(d != l) d[j] = l[j];
+              d[j].cmp(r[j], mode);
+            }
+          }
+        }else if(!ValueKernels::compareScalar(mode, d, l, other, run)){
+          for(size_t j = 0; j < run; ++j){
+            if(d != l) d[j] = l[j];
+            d[j].cmp(other, mode);
+          }
+        }
+        i += run;
+      }
+      
+      if(dst != lhs) *self = dst;
+    }else{
+      Array* rhs = other.value.array_v;
+      size_t num = rhs->size();
+      Array* dst = new Array(num);
+      mode = flipCmpMode_(mode);
+      
+      for(size_t i = 0; i < num;){
+        size_t run = std::min(rhs->runLength(i), dst->runLength(i));
+        TypedValue* d = dst->mutableData(i);
+        const TypedValue* r = rhs->data(i);
+        if(!ValueKernels::compareScalar(mode, d, r, *self, run)){
+          for(size_t j = 0; j < run; ++j){
+            d[j] = r[j];
+            d[j].cmp(*self, mode);
+          }
+        }
+        i += run;
+      }
+      
+      *self = dst;
+    }
+  }
 }
 
 //private methods
@@ -62,30 +266,58 @@ void TypedValue::clear_(){
   case TypeTag::Iterator:
     this->value.iterator_v->decRefCount();
     break;
+  #ifdef NAN_BOXED_VALUES
+  case TypeTag::Int:
+    // the word may be written again without being cleared, don't leave a stale box
+    NanBox::release(this->type.bits_);
+    this->type.bits_ = NanBox::NoneBits;
+    break;
+  #else
+  case TypeTag::SmallString:
+    // the next value may only write some of the bytes
+    memset(reinterpret_cast<char*>(this) + 1, 0, sizeof(TypedValue) - 1);
+    break;
+  #endif
   default:
     break;
   }
 }
 
 void TypedValue::move_(TypedValue&& other)noexcept{
-  this->type = other.type;
-  memcpy(&this->value, &other.value, sizeof(this->value));
+  #ifdef NAN_BOXED_VALUES
+  this->type.bits_ = other.type.bits_;
+  other.type.bits_ = NanBox::NullBits;
+  #else
+  memcpy(static_cast<void*>(this), &other, sizeof(TypedValue));
+  if(other.type == TypeTag::SmallString) other.clear_();
   other.type = TypeTag::Null;
+  #endif
 }
 
 void TypedValue::copy_(const TypedValue& other)noexcept{
+  #ifdef NAN_BOXED_VALUES
+  this->type.bits_ = other.type.bits_;
+  #else
   this->type = other.type;
+  #endif
   switch(other.type){
   case TypeTag::Null:
   case TypeTag::Bool:
   case TypeTag::Int:
   case TypeTag::Float:
+    #ifdef NAN_BOXED_VALUES
+    NanBox::retain(this->type.bits_);
+    #else
     memcpy(&this->value, &other.value, sizeof(this->value));
+    #endif
     break;
   case TypeTag::String:
     this->value.string_v = other.value.string_v;
     this->value.string_v->incRefCount();
     break;
+  case TypeTag::SmallString:
+    memcpy(static_cast<void*>(this), &other, sizeof(TypedValue));
+    break;
   case TypeTag::Func:
     this->value.func_v = other.value.func_v;
     this->value.func_v->incRefCount();
@@ -109,6 +341,77 @@ void TypedValue::copy_(const TypedValue& other)noexcept{
   }
 }
 
+bool TypedValue::isSmall_(int len){
+  #ifdef NAN_BOXED_VALUES
+  return false;
+  #else
+  return len <= SmallStringMax;
+  #endif
+}
+
+const char* TypedValue::smallData_()const{
+  return reinterpret_cast<const char*>(this) + 2;
+}
+
+int TypedValue::smallLen_()const{
+  return reinterpret_cast<const uint8_t*>(this)[1];
+}
+
+/*
+  Stores a small string in a cleared value. The unused bytes are zeroed, so that
+  equal small strings are equal bit for bit.
+*/
+void TypedValue::setSmall_(const char* str, int len){
+  assert(isSmall_(len));
+  #ifndef NAN_BOXED_VALUES
+  char* bytes = reinterpret_cast<char*>(this);
+  memset(bytes + 1, 0, sizeof(TypedValue) - 1);
+  bytes[1] = static_cast<char>(len);
+  memcpy(bytes + 2, str, len);
+  this->type = TypeTag::SmallString;
+  #endif
+}
+
+/*
+  Stores a string in a cleared value, copying it into the value if it is short
+  enough. A string that nothing else refers to is then deallocated.
+*/
+void TypedValue::setString_(String* s){
+  s->incRefCount();
+  if(isSmall_(s->len())){
+    this->setSmall_(s->data(), s->len());
+    s->decRefCount();
+  }else{
+    this->type = TypeTag::String;
+    this->value.string_v = s;
+  }
+}
+
+/*
+  Replaces a small string by a String, for the operations only implemented for
+  String. Their results replace the value, so the String does not outlive them.
+*/
+void TypedValue::promote_(){
+  assert(this->type == TypeTag::SmallString);
+  String* s = make_new<String>(this->smallData_(), this->smallLen_());
+  this->clear_();
+  this->type = TypeTag::String;
+  this->value.string_v = s;
+  s->incRefCount();
+}
+
+int TypedValue::cmpStrings_(const TypedValue& other)const{
+  const char* lhs = this->type == TypeTag::SmallString?
+    this->smallData_() : this->value.string_v->data();
+  int lhs_len = this->type == TypeTag::SmallString?
+    this->smallLen_() : this->value.string_v->len();
+  const char* rhs = other.type == TypeTag::SmallString?
+    other.smallData_() : other.value.string_v->data();
+  int rhs_len = other.type == TypeTag::SmallString?
+    other.smallLen_() : other.value.string_v->len();
+  return String::cmp(lhs, lhs_len, rhs, rhs_len);
+}
+
 //constructors
 
 TypedValue::TypedValue(){
@@ -131,9 +434,7 @@ TypedValue::TypedValue(Float f){
   value.float_v = f;
 }
 TypedValue::TypedValue(String* s){
-  type = TypeTag::String;
-  value.string_v = s;
-  s->incRefCount();
+  this->setString_(s);
 }
 TypedValue::TypedValue(Function* p){
   type = TypeTag::Func;
@@ -197,9 +498,7 @@ TypedValue& TypedValue::operator=(Float val){
 }
 TypedValue& TypedValue::operator=(String* val){
   this->clear_();
-  this->type = TypeTag::String;
-  this->value.string_v = val;
-  val->incRefCount();
+  this->setString_(val);
   return *this;
 }
 TypedValue& TypedValue::operator=(Function* val){
@@ -282,6 +581,9 @@ void TypedValue::add(const TypedValue& rhs){
         static_cast<Float>(this->value.int_v)
         + other->value.float_v;
       break;
+    case TypeTag::Array:
+      elementWise_(this, *other, &TypedValue::add, ArithOp::Add, "+");
+      break;
     default:
       goto error;
     }
@@ -294,10 +596,16 @@ void TypedValue::add(const TypedValue& rhs){
     case TypeTag::Float:
       this->value.float_v += other->value.float_v;
       break;
+    case TypeTag::Array:
+      elementWise_(this, *other, &TypedValue::add, ArithOp::Add, "+");
+      break;
     default:
       goto error;
     }
     break;
+  case TypeTag::Array:
+    elementWise_(this, *other, &TypedValue::add, ArithOp::Add, "+");
+    break;
   default:
     goto error;
   }
@@ -330,6 +638,9 @@ void TypedValue::sub(const TypedValue& rhs){
       this->value.float_v
         = static_cast<Float>(this->value.int_v) - other->value.float_v;
       break;
+    case TypeTag::Array:
+      elementWise_(this, *other, &TypedValue::sub, ArithOp::Sub, "-");
+      break;
     default:
       goto error;
     }
@@ -342,10 +653,16 @@ void TypedValue::sub(const TypedValue& rhs){
     case TypeTag::Float:
       this->value.float_v -= other->value.float_v;
       break;
+    case TypeTag::Array:
+      elementWise_(this, *other, &TypedValue::sub, ArithOp::Sub, "-");
+      break;
     default:
       goto error;
     }
     break;
+  case TypeTag::Array:
+    elementWise_(this, *other, &TypedValue::sub, ArithOp::Sub, "-");
+    break;
   default:
     goto error;
   }
@@ -378,6 +695,9 @@ void TypedValue::mul(const TypedValue& rhs){
       this->value.float_v
         = static_cast<Float>(this->value.int_v) * other->value.float_v;
       break;
+    case TypeTag::Array:
+      elementWise_(this, *other, &TypedValue::mul, ArithOp::Mul, "*");
+      break;
     default:
       goto error;
     }
@@ -390,10 +710,16 @@ void TypedValue::mul(const TypedValue& rhs){
     case TypeTag::Float:
       this->value.float_v *= other->value.float_v;
       break;
+    case TypeTag::Array:
+      elementWise_(this, *other, &TypedValue::mul, ArithOp::Mul, "*");
+      break;
     default:
       goto error;
     }
     break;
+  case TypeTag::Array:
+    elementWise_(this, *other, &TypedValue::mul, ArithOp::Mul, "*");
+    break;
   default:
     goto error;
   }
@@ -429,6 +755,9 @@ void TypedValue::div(const TypedValue& rhs){
       this->value.float_v
         = static_cast<Float>(this->value.int_v) / other->value.float_v;
       break;
+    case TypeTag::Array:
+      elementWise_(this, *other, &TypedValue::div, ArithOp::Div, "/");
+      break;
     default:
       goto type_error;
     }
@@ -441,10 +770,16 @@ void TypedValue::div(const TypedValue& rhs){
     case TypeTag::Float:
       this->value.float_v /= other->value.float_v;
       break;
+    case TypeTag::Array:
+      elementWise_(this, *other, &TypedValue::div, ArithOp::Div, "/");
+      break;
     default:
       goto type_error;
     }
     break;
+  case TypeTag::Array:
+    elementWise_(this, *other, &TypedValue::div, ArithOp::Div, "/");
+    break;
   default:
     goto type_error;
   }
@@ -493,6 +828,9 @@ void TypedValue::mod(const TypedValue& rhs){
       this->value.float_v = 
         std::fmod(static_cast<Float>(this->value.int_v), other->value.float_v);
       break;
+    case TypeTag::Array:
+      elementWise_(this, *other, &TypedValue::mod, ArithOp::Mod, "%");
+      break;
     default:
       goto type_error;
     }
@@ -506,10 +844,16 @@ void TypedValue::mod(const TypedValue& rhs){
     case TypeTag::Float:
       this->value.float_v = std::fmod(this->value.float_v, other->value.float_v);
       break;
+    case TypeTag::Array:
+      elementWise_(this, *other, &TypedValue::mod, ArithOp::Mod, "%");
+      break;
     default:
       goto type_error;
     }
     break;
+  case TypeTag::Array:
+    elementWise_(this, *other, &TypedValue::mod, ArithOp::Mod, "%");
+    break;
   default:
     goto type_error;
   }
@@ -549,10 +893,14 @@ void TypedValue::append(const TypedValue& rhs){
     switch(other->type){
     case TypeTag::String:
       *this = make_new<String>(
-        this->value.bool_v,
+        this->asBool(),
         (const String*)other->value.string_v
       );
       break;
+    case TypeTag::SmallString:
+      this->toString();
+      this->append(*other);
+      break;
     case TypeTag::Array:
       *this = constructArray(new Array, *this, *other->value.array_v);
       break;
@@ -564,10 +912,14 @@ void TypedValue::append(const TypedValue& rhs){
     switch(other->type){
     case TypeTag::String:
       *this = make_new<String>(
-        this->value.int_v,
+        this->asInt(),
         (const String*)other->value.string_v
       );
       break;
+    case TypeTag::SmallString:
+      this->toString();
+      this->append(*other);
+      break;
     case TypeTag::Array:
       *this = constructArray(new Array, *this, *other->value.array_v);
       break;
@@ -579,10 +931,14 @@ void TypedValue::append(const TypedValue& rhs){
     switch(other->type){
     case TypeTag::String:
       *this = make_new<String>(
-        this->value.float_v,
+        this->asFloat(),
         (const String*)other->value.string_v
       );
       break;
+    case TypeTag::SmallString:
+      this->toString();
+      this->append(*other);
+      break;
     case TypeTag::Array:
       *this = constructArray(new Array, *this, *other->value.array_v);
       break;
@@ -593,29 +949,64 @@ void TypedValue::append(const TypedValue& rhs){
   case TypeTag::String:
     switch(other->type){
     case TypeTag::Bool:
-      *this = make_new<String>(
-        (const String*)this->value.string_v,
-        other->value.bool_v
-      );
+      setAppended_(this, this->value.string_v->append(other->value.bool_v));
       break;
     case TypeTag::Int:
-      *this = make_new<String>(
-        (const String*)this->value.string_v,
-        other->value.int_v
-      );
+      setAppended_(this, this->value.string_v->append(other->value.int_v));
       break;
     case TypeTag::Float:
-      *this = make_new<String>(
-        (const String*)this->value.string_v,
-        other->value.float_v
+      setAppended_(this, this->value.string_v->append(other->value.float_v));
+      break;
+    case TypeTag::String:
+      setAppended_(this, this->value.string_v->append(other->value.string_v));
+      break;
+    case TypeTag::SmallString:
+      setAppended_(
+        this, this->value.string_v->append(other->smallData_(), other->smallLen_())
       );
       break;
+    case TypeTag::Array:
+      *this = constructArray(new Array, *this, *other->value.array_v);
+      break;
+    default:
+      goto error;
+    }
+    break;
+  case TypeTag::SmallString:
+    switch(other->type){
+    case TypeTag::Bool:
+    case TypeTag::Int:
+    case TypeTag::Float:
+      {
+        TypedValue str = *other;
+        str.toString();
+        this->append(str);
+      }
+      break;
     case TypeTag::String:
       *this = make_new<String>(
-        (const String*)this->value.string_v,
+        this->smallData_(),
+        this->smallLen_(),
         (const String*)other->value.string_v
       );
       break;
+    case TypeTag::SmallString:
+      {
+        int len = this->smallLen_();
+        int other_len = other->smallLen_();
+        if(isSmall_(len + other_len)){
+          char buffer[sizeof(TypedValue)];
+          memcpy(buffer, this->smallData_(), len);
+          memcpy(buffer + len, other->smallData_(), other_len);
+          this->setSmall_(buffer, len + other_len);
+        }else{
+          char buffer[sizeof(TypedValue) * 2];
+          memcpy(buffer, this->smallData_(), len);
+          memcpy(buffer + len, other->smallData_(), other_len);
+          *this = make_new<String>(static_cast<const char*>(buffer), len + other_len);
+        }
+      }
+      break;
     case TypeTag::Array:
       *this = constructArray(new Array, *this, *other->value.array_v);
       break;
@@ -624,14 +1015,11 @@ void TypedValue::append(const TypedValue& rhs){
     }
     break;
   case TypeTag::Array:
+    // the array may be shared, with a variable or the constants of a function
+    this->clone();
     switch(other->type){
     case TypeTag::Array:
-      *this = new Array(*this->value.array_v);
-      std::copy(
-        other->value.array_v->begin(),
-        other->value.array_v->end(),
-        std::back_inserter(*this->value.array_v)
-      );
+      this->value.array_v->append(*other->value.array_v);
       break;
     default:
       this->value.array_v->push_back(*other);
@@ -665,17 +1053,23 @@ error:
 void TypedValue::append(TypedValue&& rhs){
   TypedValue* other = &rhs;
   
+  // small strings are copied as cheaply as they are moved
+  if(this->type == TypeTag::SmallString || other->type == TypeTag::SmallString){
+    this->append(static_cast<const TypedValue&>(rhs));
+    return;
+  }
+  
   switch(this->type){
   case TypeTag::Bool:
     switch(other->type){
     case TypeTag::String:
       *this = make_new<String>(
-        this->value.bool_v,
+        this->asBool(),
         (const String*)other->value.string_v
       );
       break;
     case TypeTag::Array:
-      other->value.array_v->insert(other->value.array_v->begin(), std::move(*this));
+      other->value.array_v->push_front(std::move(*this));
       *this = std::move(*other);
       break;
     default:
@@ -685,12 +1079,12 @@ void TypedValue::append(TypedValue&& rhs){
     switch(other->type){
     case TypeTag::String:
       *this = make_new<String>(
-        this->value.int_v,
+        this->asInt(),
         (const String*)other->value.string_v
       );
       break;
     case TypeTag::Array:
-      other->value.array_v->insert(other->value.array_v->begin(), std::move(*this));
+      other->value.array_v->push_front(std::move(*this));
       *this = std::move(*other);
       break;
     default:
@@ -701,12 +1095,12 @@ void TypedValue::append(TypedValue&& rhs){
     switch(other->type){
     case TypeTag::String:
       *this = make_new<String>(
-        this->value.float_v,
+        this->asFloat(),
         (const String*)other->value.string_v
       );
       break;
     case TypeTag::Array:
-      other->value.array_v->insert(other->value.array_v->begin(), std::move(*this));
+      other->value.array_v->push_front(std::move(*this));
       *this = std::move(*other);
       break;
     default:
@@ -716,31 +1110,19 @@ void TypedValue::append(TypedValue&& rhs){
   case TypeTag::String:
     switch(other->type){
     case TypeTag::Bool:
-      *this = make_new<String>(
-        (const String*)this->value.string_v,
-        other->value.bool_v
-      );
+      setAppended_(this, this->value.string_v->append(other->value.bool_v));
       break;
     case TypeTag::Int:
-      *this = make_new<String>(
-        (const String*)this->value.string_v,
-        other->value.int_v
-      );
+      setAppended_(this, this->value.string_v->append(other->value.int_v));
       break;
     case TypeTag::Float:
-      *this = make_new<String>(
-        (const String*)this->value.string_v,
-        other->value.float_v
-      );
+      setAppended_(this, this->value.string_v->append(other->value.float_v));
       break;
     case TypeTag::String:
-      *this = make_new<String>(
-        (const String*)this->value.string_v,
-        (const String*)other->value.string_v
-      );
+      setAppended_(this, this->value.string_v->append(other->value.string_v));
       break;
     case TypeTag::Array:
-      other->value.array_v->insert(other->value.array_v->begin(), std::move(*this));
+      other->value.array_v->push_front(std::move(*this));
       *this = std::move(*other);
       break;
     default:
@@ -748,13 +1130,10 @@ void TypedValue::append(TypedValue&& rhs){
     }
     break;
   case TypeTag::Array:
+    this->clone();
     switch(other->type){
     case TypeTag::Array:
-      std::copy(
-        other->value.array_v->begin(),
-        other->value.array_v->end(),
-        std::back_inserter(*this->value.array_v)
-      );
+      this->value.array_v->append(*other->value.array_v);
       other->value.array_v->decRefCount();
       other->type = TypeTag::Null;
       break;
@@ -762,6 +1141,7 @@ void TypedValue::append(TypedValue&& rhs){
       this->value.array_v->push_back(std::move(*other));
       break;
     }
+    break;
   default:
     switch(other->type){
     case TypeTag::Array:
@@ -816,21 +1196,23 @@ void TypedValue::in(const TypedValue& rhs){
   
   switch(other->type){
   case TypeTag::Array:
-    for(auto& val: *other->value.array_v){
-      if(*this == val){
-        *this = true;
-        return;
+    {
+      Array* arr = other->value.array_v;
+      bool found = false;
+      for(size_t i = 0; i < arr->size() && !found;){
+        size_t run = arr->runLength(i);
+        found = ValueKernels::indexOf(arr->data(i), arr->data(i) + run, *this) >= 0;
+        i += run;
       }
+      *this = found;
     }
-    *this = false;
     break;
   case TypeTag::Table:
     {
       if(!this->isHashable()){
         *this = false;
       }
-      auto it = other->value.table_v->find(*this);
-      *this = it != other->value.table_v->end();
+      *this = other->value.table_v->find(*this) != nullptr;
     }
     break;
   default:
@@ -888,11 +1270,9 @@ void TypedValue::cmp(const TypedValue& rhs){
     }else goto error;
     break;
   case TypeTag::String:
-    if(other->type == TypeTag::String){
-      this->type = TypeTag::Int;
-      auto val = this->value.string_v->cmp(*other->value.string_v);
-      this->value.string_v->decRefCount();
-      this->value.int_v = val;
+  case TypeTag::SmallString:
+    if(other->isString()){
+      *this = static_cast<Int>(this->cmpStrings_(*other));
     }else goto error;
     break;
   default:
@@ -915,10 +1295,26 @@ error:
 
 void TypedValue::cmp(const TypedValue& rhs, CmpMode mode){
   const TypedValue* other = &rhs;
+  int cmp;
   
-  if(this->type != other->type) goto error;
+  if(this->type != other->type){
+    if(this->isString() && other->isString()){
+      // strings short enough to be small are always small
+      if(mode == CmpMode::Equal || mode == CmpMode::NotEqual) cmp = 1;
+      else cmp = this->cmpStrings_(*other);
+      this->clear_();
+      goto result;
+    }
+    if(
+      (this->type == TypeTag::Array || other->type == TypeTag::Array)
+      && mode != CmpMode::Equal && mode != CmpMode::NotEqual
+    ){
+      cmpElementWise_(this, *other, mode);
+      return;
+    }
+    goto error;
+  }
   
-  int cmp;
   switch(this->type){
   case TypeTag::Null:
     cmp = 0;
@@ -927,7 +1323,10 @@ void TypedValue::cmp(const TypedValue& rhs, CmpMode mode){
     cmp = this->value.bool_v - other->value.bool_v;
     break;
   case TypeTag::Int:
-    cmp = this->value.int_v - other->value.int_v;
+    {
+      Int lhs = this->value.int_v, rhs = other->value.int_v;
+      cmp = lhs < rhs? -1 : (lhs > rhs? 1 : 0);
+    }
     break;
   case TypeTag::Float:
     {
@@ -936,13 +1335,34 @@ void TypedValue::cmp(const TypedValue& rhs, CmpMode mode){
     }
     break;
   case TypeTag::String:
-    cmp = this->value.string_v->cmp(*other->value.string_v);
+    if(mode == CmpMode::Equal || mode == CmpMode::NotEqual){
+      cmp = stringsEqual_(this, other)? 0 : 1;
+    }else{
+      cmp = this->value.string_v->cmp(*other->value.string_v);
+    }
     this->value.string_v->decRefCount();
     break;
+  case TypeTag::SmallString:
+    if(mode == CmpMode::Equal || mode == CmpMode::NotEqual){
+      cmp = memcmp(this, other, sizeof(TypedValue)) == 0? 0 : 1;
+    }else{
+      cmp = this->cmpStrings_(*other);
+    }
+    this->clear_();
+    break;
+  case TypeTag::Array:
+    if(mode != CmpMode::Equal && mode != CmpMode::NotEqual){
+      cmpElementWise_(this, *other, mode);
+      return;
+    }
+    cmp = *this == *other? 0 : 1;
+    this->value.array_v->decRefCount();
+    break;
   default:
     goto error;
   }
   
+result:
   this->type = TypeTag::Bool;
   
   switch(mode){
@@ -1000,15 +1420,18 @@ void TypedValue::get(const TypedValue& rhs){
       }else goto type_error;
       if(index < 0) index = this->value.array_v->size() + index;
       if(index >= this->value.array_v->size()) goto index_error;
-      *this = this->value.array_v->operator[](index);
+      // the element may only be kept alive by the array being replaced
+      TypedValue elem = this->value.array_v->operator[](index);
+      *this = std::move(elem);
     }
     break;
   case TypeTag::Table:
     {
       if(!other->isHashable()) goto type_error;
-      auto it = this->value.table_v->find(*other);
-      if(it == this->value.table_v->end()) goto lookup_error;
-      *this = it->second;
+      auto val = this->value.table_v->find(*other);
+      if(!val) goto lookup_error;
+      TypedValue elem = *val;
+      *this = std::move(elem);
     }
     break;
   case TypeTag::String:
@@ -1020,7 +1443,25 @@ void TypedValue::get(const TypedValue& rhs){
       if(index < 0) index = this->value.string_v->utf8Len() + index;
       auto glyph = this->value.string_v->utf8Get(index);
       if(glyph == 0xffffffff) goto index_error;
-      *this = make_new<String, uint32_t>(glyph);
+      if(glyph < 0x80) *this = String::ascii(glyph);
+      else *this = make_new<String, uint32_t>(glyph);
+    }
+    break;
+  case TypeTag::SmallString:
+    if(!isAscii_(this->smallData_(), this->smallLen_())){
+      this->promote_();
+      this->get(*other);
+      return;
+    }
+    {
+      Int index;
+      if(other->type == TypeTag::Int){
+        index = other->value.int_v;
+      }else goto type_error;
+      if(index < 0) index = this->smallLen_() + index;
+      if(index < 0 || index >= this->smallLen_()) goto index_error;
+      char c = this->smallData_()[index];
+      this->setSmall_(&c, 1);
     }
     break;
   default:
@@ -1119,10 +1560,31 @@ void TypedValue::slice(const TypedValue& rhs1, const TypedValue& rhs2){
     if(index2 <= index1){
       *this = make_new<String>();
     }else{
-      *this = make_new<String>(
-        this->value.string_v->str() + index1,
-        (int)(index2 - index1)
-      );
+      String* str = this->value.string_v;
+      *this = str->slice(str->utf82Idx(index1), str->utf82Idx(index2));
+    }
+    break;
+  case TypeTag::SmallString:
+    if(!isAscii_(this->smallData_(), this->smallLen_())){
+      this->promote_();
+      this->slice(*other1, *other2);
+      return;
+    }
+    {
+      int size = this->smallLen_();
+      
+      if(index1 < 0) index1 = size + index1;
+      if(index2 < 0) index2 = size + index2;
+      
+      if(index1 < 0) index1 = 0;
+      else if(index1 >= size) index1 = size;
+      if(index2 < 0) index2 = 0;
+      else if(index2 >= size) index2 = size;
+      
+      char buffer[sizeof(TypedValue)];
+      int len = index2 > index1? index2 - index1 : 0;
+      memcpy(buffer, this->smallData_() + index1, len);
+      this->setSmall_(buffer, len);
     }
     break;
   default:
@@ -1171,7 +1633,7 @@ void TypedValue::getBorrowed(const TypedValue& other){
         if(idx < 0 || idx >= borrowed->value.array_v->size()) goto index_error;
         
         borrowed->clone();
-        borrowed = &borrowed->value.array_v->operator[](idx);
+        borrowed = &borrowed->value.array_v->getMutable(idx);
       }
       break;
     default:
@@ -1183,11 +1645,11 @@ void TypedValue::getBorrowed(const TypedValue& other){
       if(!other.isHashable()) goto type_error;
       auto& borrowed = this->value.borrowed_v;
       borrowed->clone();
-      auto it = borrowed->value.table_v->find(other);
-      if(it == borrowed->value.table_v->end()){
+      auto val = borrowed->value.table_v->findMutable(other);
+      if(!val){
         goto lookup_error;
       }
-      borrowed = &it->second;
+      borrowed = val;
     }
     break;
   default:
@@ -1246,8 +1708,7 @@ void TypedValue::getInserted(const TypedValue& other){
       if(!other.isHashable()) goto type_error;
       auto& borrowed = this->value.borrowed_v;
       borrowed->clone();
-      auto it = borrowed->value.table_v->emplace(std::make_pair(other, nullptr));
-      borrowed = &it.first->second;
+      borrowed = borrowed->value.table_v->findOrInsert(other);
     }
     break;
   default:
@@ -1342,6 +1803,9 @@ void TypedValue::toInt(){
   case TypeTag::Float:
     this->value.int_v = static_cast<Int>(this->value.float_v);
     break;
+  case TypeTag::SmallString:
+    this->promote_();
+    [[fallthrough]];
   case TypeTag::String: {
       Int i;
       if(!toInt_(this->value.string_v, &i)){
@@ -1391,6 +1855,9 @@ void TypedValue::toFloat(){
     break;
   case TypeTag::Float:
     break;
+  case TypeTag::SmallString:
+    this->promote_();
+    [[fallthrough]];
   case TypeTag::String: {
       Float f;
       if(!toFloat_(this->value.string_v, &f)){
@@ -1437,18 +1904,19 @@ void TypedValue::toString(){
     s = make_new<String>(this->value.bool_v? "true" : "false");
     break;
   case TypeTag::Int:
-    s = make_new<String>(this->value.int_v);
+    s = String::smallInt(this->value.int_v);
+    if(s == nullptr) s = make_new<String>(this->asInt());
     break;
   case TypeTag::Float:
-    s = make_new<String>(this->value.float_v);
+    s = make_new<String>(this->asFloat());
     break;
   case TypeTag::String:
+  case TypeTag::SmallString:
     return;
   default:
     goto error;
   }
-  this->value.string_v = s;
-  s->incRefCount();
+  *this = s;
   return;
   
 error:
@@ -1475,7 +1943,7 @@ void TypedValue::toPartial(){
     delete[] msg;
     vm->errorJmp(1);
   }
-  auto proc = this->value.func_v;
+  Function* proc = this->value.func_v;
   this->value.partial_v = new PartiallyApplied(proc);
   this->value.partial_v->incRefCount();
   proc->decRefCount();
@@ -1508,6 +1976,24 @@ void TypedValue::steal(){
   *this = std::move(*this->value.borrowed_v);
 }
 
+void TypedValue::borrowFrom(const TypedValue& other){
+  this->clear_();
+  #ifdef NAN_BOXED_VALUES
+  this->type.bits_ = other.type.bits_;
+  #else
+  memcpy(static_cast<void*>(this), &other, sizeof(TypedValue));
+  #endif
+}
+
+void TypedValue::forget(){
+  #ifdef NAN_BOXED_VALUES
+  this->type.bits_ = NanBox::NullBits;
+  #else
+  memset(static_cast<void*>(this), 0, sizeof(TypedValue));
+  this->type = TypeTag::Null;
+  #endif
+}
+
 const char* TypedValue::typeStr() const {
   switch(this->type){
   case TypeTag::Null:
@@ -1519,6 +2005,7 @@ const char* TypedValue::typeStr() const {
   case TypeTag::Float:
     return "float";
   case TypeTag::String:
+  case TypeTag::SmallString:
     return "string";
   case TypeTag::Func:
   case TypeTag::Partial:
@@ -1536,29 +2023,70 @@ const char* TypedValue::typeStr() const {
 std::unique_ptr<char[]> TypedValue::toCStr() const {
   switch(this->type){
   case TypeTag::Bool:
-    return std::unique_ptr<char[]>
-      (dynSprintf("%s", this->value.bool_v? "true" : "false"));
+    return this->value.bool_v? copyCStr_("true", 4) : copyCStr_("false", 5);
   case TypeTag::Int:
-    return std::unique_ptr<char[]>
-      (dynSprintf("%lld", (long long)this->value.int_v));
+    {
+      char buffer[24];
+      auto res = std::to_chars(buffer, buffer + sizeof(buffer), this->value.int_v);
+      return copyCStr_(buffer, res.ptr - buffer);
+    }
   case TypeTag::Float:
-    return std::unique_ptr<char[]>
-      (dynSprintf("%f", (double)this->value.float_v));
+    {
+      //formatted like printf's %f, which may need all digits of the largest float
+      char buffer[std::numeric_limits<Float>::max_exponent10 + 16];
+      auto res = std::to_chars(
+        buffer, buffer + sizeof(buffer), this->value.float_v, std::chars_format::fixed, 6
+      );
+      return copyCStr_(buffer, res.ptr - buffer);
+    }
   case TypeTag::String:
-    return std::unique_ptr<char[]>
-      (dynSprintf("%s", this->value.string_v->str()));
+    return copyCStr_(this->value.string_v->data(), this->value.string_v->len());
+  case TypeTag::SmallString:
+    return copyCStr_(this->smallData_(), this->smallLen_());
   default:
     return std::unique_ptr<char[]>
-      (dynSprintf("%s: %p", this->typeStr(), this->value.ptr_v));
+      (dynSprintf("%s: %p", this->typeStr(), static_cast<void*>(this->value.ptr_v)));
   }
 }
 
 bool TypedValue::isHashable()const{
-  return this->type == TypeTag::Int || this->type == TypeTag::String;
+  return this->type == TypeTag::Int || this->isString();
 }
 
 bool TypedValue::operator==(const TypedValue& other)const{
-  return this->type == other.type && this->value.ptr_v == other.value.ptr_v;
+  if(this->type != other.type) return false;
+  switch(this->type){
+  case TypeTag::Null:
+    return true;
+  case TypeTag::Bool:
+    return this->value.bool_v == other.value.bool_v;
+  case TypeTag::Int:
+    return this->value.int_v == other.value.int_v;
+  case TypeTag::Float:
+    return this->value.float_v == other.value.float_v;
+  case TypeTag::String:
+    return *this->value.string_v == *other.value.string_v;
+  case TypeTag::SmallString:
+    return memcmp(this, &other, sizeof(TypedValue)) == 0;
+  case TypeTag::Array:
+    {
+      Array* lhs = this->value.array_v;
+      Array* rhs = other.value.array_v;
+      if(lhs == rhs) return true;
+      if(lhs->size() != rhs->size()) return false;
+      for(size_t i = 0; i < lhs->size();){
+        size_t run = std::min(lhs->runLength(i), rhs->runLength(i));
+        if(
+          lhs->data(i) != rhs->data(i)
+          && !ValueKernels::equal(lhs->data(i), rhs->data(i), run)
+        ) return false;
+        i += run;
+      }
+      return true;
+    }
+  default:
+    return this->value.ptr_v == other.value.ptr_v;
+  }
 }
 
 #ifndef NDEBUG
@@ -1578,6 +2106,8 @@ std::string TypedValue::toStrDebug()const{
     return this->value.floatToStrDebug();
   case TypeTag::String:
     return this->value.toStrDebug();
+  case TypeTag::SmallString:
+    return std::string(this->smallData_(), this->smallLen_());
   case TypeTag::Func:
     return this->value.func_v->toStrDebug();
   case TypeTag::Partial:
@@ -1589,7 +2119,7 @@ std::string TypedValue::toStrDebug()const{
   default:
     {
       char buffer[20];
-      sprintf(buffer, "%p", this->value.ptr_v);
+      sprintf(buffer, "%p", static_cast<void*>(this->value.ptr_v));
       return buffer;
     }
   }
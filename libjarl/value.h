@@ -3,11 +3,11 @@
 
 #include "string.h"
 #include "function.h"
-#include "array.h"
 
 #include <jarl.h>
 
 #include <functional>
+#include <cstring>
 
 #ifndef NDEBUG
 #include <string>
@@ -29,7 +29,12 @@ constexpr Float operator"" _f(long double f){
   return static_cast<Float>(f);
 }
 
-enum class TypeTag: Int{
+/*
+  SmallString is a string of at most TypedValue::SmallStringMax bytes stored in the
+  value itself. It is a string to the language, and the only form strings that short
+  take in a TypedValue, see TypedValue(String*).
+*/
+enum class TypeTag: uint8_t{
   None,
   Null,
   Ptr,
@@ -42,9 +47,15 @@ enum class TypeTag: Int{
   Array,
   Table,
   Iterator,
-  Borrow
+  Borrow,
+  SmallString
 };
 
+#ifdef NAN_BOXED_VALUES
+// the compact layout of TypedValue, it needs the tags above
+# include "nan_box.h"
+#endif
+
 enum class CmpMode{
   Equal,
   NotEqual,
@@ -110,11 +121,40 @@ class TypedValue{
   void move_(TypedValue&&)noexcept;
   void copy_(const TypedValue&)noexcept;
   
+  static bool isSmall_(int len);
+  const char* smallData_()const;
+  int smallLen_()const;
+  void setSmall_(const char*, int);
+  void setString_(String*);
+  void promote_();
+  int cmpStrings_(const TypedValue&)const;
+  
 public:
   
+  #ifdef NAN_BOXED_VALUES
+  union{
+    NanBox::TypeField type{};
+    NanBox::ValueField value;
+  };
+  #else
   TypeTag type;
+  
+private:
+  /*
+    A small string keeps its length in the first byte and its characters in the
+    rest of this and in value, with the unused bytes zero. For every other type
+    these bytes are zero, so the first 8 bytes of a value compare as a full width
+    tag, see value_kernels.h.
+  */
+  uint8_t small_[7] = {};
+  
+public:
   Value value;
   
+  // strings up to this length are stored as SmallString
+  static constexpr int SmallStringMax = sizeof(small_) - 1 + sizeof(Value);
+  #endif
+  
   TypedValue();
   TypedValue(nullptr_t);
   TypedValue(bool);
@@ -185,6 +225,13 @@ public:
   void clone();
   void steal();
   
+  /*
+    borrowFrom makes this a copy of a value without taking a reference of its own.
+    It must be dropped with forget before the value it was copied from goes away.
+  */
+  void borrowFrom(const TypedValue&);
+  void forget();
+  
   const char* typeStr() const;
   std::unique_ptr<char[]> toCStr() const;
   
@@ -193,6 +240,10 @@ public:
   Float asFloat()const{return this->value.float_v;}
   const String* asString()const{return this->value.string_v;}
   
+  bool isString()const{
+    return this->type == TypeTag::String || this->type == TypeTag::SmallString;
+  }
+  
   bool isHashable()const;
   
   bool operator==(const TypedValue&)const;
@@ -202,7 +253,11 @@ public:
   #endif
 };
 
+#ifdef NAN_BOXED_VALUES
+static_assert(sizeof(TypedValue) == sizeof(uint64_t));
+#else
 static_assert(sizeof(TypedValue) == sizeof(void*) * 2);
+#endif
 
 namespace std{
   
@@ -221,6 +276,8 @@ namespace std{
         return lhs.value.float_v == rhs.value.float_v;
       case TypeTag::String:
         return std::equal_to<String>()(*lhs.value.string_v, *rhs.value.string_v);
+      case TypeTag::SmallString:
+        return memcmp(&lhs, &rhs, sizeof(TypedValue)) == 0;
       default:
         return false;
       }
@@ -229,10 +286,20 @@ namespace std{
   
   template<> struct hash<TypedValue>{
     size_t operator()(const TypedValue& arg)const{
+      #ifndef NAN_BOXED_VALUES
+      if(arg.type == TypeTag::SmallString){
+        uint64_t words[2];
+        memcpy(words, &arg, sizeof(words));
+        return words[0] ^ (words[1] * 0x9e3779b97f4a7c15ull);
+      }
+      #endif
       return arg.value.int_v ^ static_cast<Int>(arg.type);
     }
   };
 }
 
 
+// Array stores TypedValue by value, so it needs the complete type
+#include "array.h"
+
 #endif
\ No newline at end of file
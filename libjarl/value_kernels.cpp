@@ -0,0 +1,617 @@
+#include "value_kernels.h"
+
+#include "value.h"
+
+#include <utility>
+
+#include <cstring>
+#include <cstdint>
+
+#if defined(__x86_64__) && !defined(NAN_BOXED_VALUES)
+#define VALUE_KERNELS_X86
+#include <immintrin.h>
+
+static_assert(sizeof(TypedValue) == 16, "value kernels assume 16 byte values");
+static_assert(sizeof(TypeTag) == 1, "value kernels assume 1 byte type tags");
+#endif
+
+#ifndef NAN_BOXED_VALUES
+
+namespace{
+
+  enum class NeedleKind{
+    Bitwise,
+    Float,
+    Scalar
+  };
+
+  inline NeedleKind needleKind_(const TypedValue& needle){
+    switch(needle.type){
+    case TypeTag::Int:
+    case TypeTag::Func:
+    case TypeTag::Partial:
+    case TypeTag::Table:
+    case TypeTag::SmallString:
+      return NeedleKind::Bitwise;
+    case TypeTag::Float:
+      return NeedleKind::Float;
+    default:
+      return NeedleKind::Scalar;
+    }
+  }
+
+  ptrdiff_t indexOfScalar_(
+    const TypedValue* begin,
+    const TypedValue* end,
+    const TypedValue& needle
+  ){
+    for(auto it = begin; it != end; ++it){
+      if(*it == needle) return it - begin;
+    }
+    return -1;
+  }
+
+  ptrdiff_t indexOfBitwiseGeneric_(
+    const TypedValue* begin,
+    const TypedValue* end,
+    const TypedValue& needle
+  ){
+    for(auto it = begin; it != end; ++it){
+      if(memcmp(it, &needle, sizeof(TypedValue)) == 0) return it - begin;
+    }
+    return -1;
+  }
+
+  #ifndef VALUE_KERNELS_X86
+  ptrdiff_t indexOfFloatGeneric_(
+    const TypedValue* begin,
+    const TypedValue* end,
+    const TypedValue& needle
+  ){
+    for(auto it = begin; it != end; ++it){
+      if(it->type == TypeTag::Float && it->value.float_v == needle.value.float_v){
+        return it - begin;
+      }
+    }
+    return -1;
+  }
+
+  bool equalGeneric_(const TypedValue* lhs, const TypedValue* rhs, size_t num){
+    for(size_t i = 0; i < num; ++i){
+      if(memcmp(lhs + i, rhs + i, sizeof(TypedValue)) != 0 && !(lhs[i] == rhs[i])){
+        return false;
+      }
+    }
+    return true;
+  }
+  #else
+
+  //SSE2 kernels, one value per register.
+
+  ptrdiff_t indexOfBitwiseSSE2_(
+    const TypedValue* begin,
+    const TypedValue* end,
+    const TypedValue& needle
+  ){
+    const __m128i key = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&needle));
+    const TypedValue* it = begin;
+    for(; end - it >= 4; it += 4){
+      auto p = reinterpret_cast<const __m128i*>(it);
+      int m0 = _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_loadu_si128(p + 0), key));
+      int m1 = _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_loadu_si128(p + 1), key));
+      int m2 = _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_loadu_si128(p + 2), key));
+      int m3 = _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_loadu_si128(p + 3), key));
+      if(m0 == 0xffff) return it - begin;
+      if(m1 == 0xffff) return it - begin + 1;
+      if(m2 == 0xffff) return it - begin + 2;
+      if(m3 == 0xffff) return it - begin + 3;
+    }
+    auto rest = indexOfBitwiseGeneric_(it, end, needle);
+    return rest < 0? rest : (it - begin) + rest;
+  }
+
+  ptrdiff_t indexOfFloatSSE2_(
+    const TypedValue* begin,
+    const TypedValue* end,
+    const TypedValue& needle
+  ){
+    //lane 0 holds the type tag, compared bitwise, lane 1 the value, compared as a
+    //double so that 0.0 == -0.0 and nan != nan.
+    const __m128i tag_mask = _mm_set_epi64x(0, -1);
+    const __m128i key_tag = _mm_set_epi64x(0, static_cast<int64_t>(TypeTag::Float));
+    const __m128d key_val = _mm_set1_pd(needle.value.float_v);
+    for(auto it = begin; it != end; ++it){
+      __m128i val = _mm_loadu_si128(reinterpret_cast<const __m128i*>(it));
+      __m128i tag_eq = _mm_and_si128(_mm_cmpeq_epi32(val, key_tag), tag_mask);
+      __m128i val_eq = _mm_andnot_si128(
+        tag_mask,
+        _mm_castpd_si128(_mm_cmpeq_pd(_mm_castsi128_pd(val), key_val))
+      );
+      if(_mm_movemask_epi8(_mm_or_si128(tag_eq, val_eq)) == 0xffff){
+        return it - begin;
+      }
+    }
+    return -1;
+  }
+
+  bool equalSSE2_(const TypedValue* lhs, const TypedValue* rhs, size_t num){
+    for(size_t i = 0; i < num; ++i){
+      __m128i l = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lhs + i));
+      __m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rhs + i));
+      if(_mm_movemask_epi8(_mm_cmpeq_epi32(l, r)) != 0xffff && !(lhs[i] == rhs[i])){
+        return false;
+      }
+    }
+    return true;
+  }
+
+  //AVX2 kernels, two values per register.
+
+  __attribute__((target("avx2")))
+  ptrdiff_t indexOfBitwiseAVX2_(
+    const TypedValue* begin,
+    const TypedValue* end,
+    const TypedValue& needle
+  ){
+    const __m256i key = _mm256_broadcastsi128_si256(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(&needle))
+    );
+    const TypedValue* it = begin;
+    for(; end - it >= 4; it += 4){
+      auto p = reinterpret_cast<const __m256i*>(it);
+      int m0 = _mm256_movemask_pd(_mm256_castsi256_pd(
+        _mm256_cmpeq_epi64(_mm256_loadu_si256(p + 0), key)
+      ));
+      int m1 = _mm256_movemask_pd(_mm256_castsi256_pd(
+        _mm256_cmpeq_epi64(_mm256_loadu_si256(p + 1), key)
+      ));
+      //a value matches when both its lanes match.
+      int hits = (m0 & (m0 >> 1) & 0x5) | ((m1 & (m1 >> 1) & 0x5) << 4);
+      if(hits != 0){
+        return (it - begin) + (__builtin_ctz(hits) >> 1);
+      }
+    }
+    auto rest = indexOfBitwiseSSE2_(it, end, needle);
+    return rest < 0? rest : (it - begin) + rest;
+  }
+
+  __attribute__((target("avx2")))
+  ptrdiff_t indexOfFloatAVX2_(
+    const TypedValue* begin,
+    const TypedValue* end,
+    const TypedValue& needle
+  ){
+    const __m256i key_tag = _mm256_set1_epi64x(static_cast<int64_t>(TypeTag::Float));
+    const __m256d key_val = _mm256_set1_pd(needle.value.float_v);
+    const TypedValue* it = begin;
+    for(; end - it >= 2; it += 2){
+      __m256i val = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(it));
+      __m256i tag_eq = _mm256_cmpeq_epi64(val, key_tag);
+      __m256d val_eq = _mm256_cmp_pd(_mm256_castsi256_pd(val), key_val, _CMP_EQ_OQ);
+      int m = _mm256_movemask_pd(
+        _mm256_blend_pd(_mm256_castsi256_pd(tag_eq), val_eq, 0xa)
+      );
+      int hits = m & (m >> 1) & 0x5;
+      if(hits != 0){
+        return (it - begin) + (__builtin_ctz(hits) >> 1);
+      }
+    }
+    auto rest = indexOfFloatSSE2_(it, end, needle);
+    return rest < 0? rest : (it - begin) + rest;
+  }
+
+  __attribute__((target("avx2")))
+  bool equalAVX2_(const TypedValue* lhs, const TypedValue* rhs, size_t num){
+    size_t i = 0;
+    for(; i + 2 <= num; i += 2){
+      __m256i l = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(lhs + i));
+      __m256i r = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rhs + i));
+      int m = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(l, r)));
+      if(m != 0xf){
+        if((m & 0x3) != 0x3 && !(lhs[i] == rhs[i])) return false;
+        if((m & 0xc) != 0xc && !(lhs[i + 1] == rhs[i + 1])) return false;
+      }
+    }
+    return equalSSE2_(lhs + i, rhs + i, num - i);
+  }
+
+  #endif
+
+  struct Dispatch_{
+    ptrdiff_t (*index_of_bitwise)(const TypedValue*, const TypedValue*, const TypedValue&);
+    ptrdiff_t (*index_of_float)(const TypedValue*, const TypedValue*, const TypedValue&);
+    bool (*equal)(const TypedValue*, const TypedValue*, size_t);
+    bool avx2 = false;
+
+    Dispatch_(){
+      #ifdef VALUE_KERNELS_X86
+      __builtin_cpu_init();
+      if(__builtin_cpu_supports("avx2")){
+        this->avx2 = true;
+        this->index_of_bitwise = indexOfBitwiseAVX2_;
+        this->index_of_float = indexOfFloatAVX2_;
+        this->equal = equalAVX2_;
+      }else{
+        this->index_of_bitwise = indexOfBitwiseSSE2_;
+        this->index_of_float = indexOfFloatSSE2_;
+        this->equal = equalSSE2_;
+      }
+      #else
+      this->index_of_bitwise = indexOfBitwiseGeneric_;
+      this->index_of_float = indexOfFloatGeneric_;
+      this->equal = equalGeneric_;
+      #endif
+    }
+  };
+
+  const Dispatch_& dispatch_(){
+    static const Dispatch_ dispatch;
+    return dispatch;
+  }
+  
+  //element-wise arithmetic and comparison
+  
+  using ValueKernels::ArithOp;
+  
+  inline bool allOfType_(const TypedValue* vals, size_t num, TypeTag type){
+    for(size_t i = 0; i < num; ++i){
+      if(vals[i].type != type) return false;
+    }
+    return true;
+  }
+  
+  /*
+    Returns the type of the operands if the kernels can handle the operation,
+    otherwise None.
+  */
+  TypeTag arithType_(ArithOp op, const TypedValue* lhs, size_t num, TypeTag rhs_type){
+    if(num == 0) return TypeTag::None;
+    TypeTag type = lhs[0].type;
+    if(type != rhs_type) return TypeTag::None;
+    switch(type){
+    case TypeTag::Int:
+      if(op == ArithOp::Div || op == ArithOp::Mod) return TypeTag::None;
+      break;
+    case TypeTag::Float:
+      if(op == ArithOp::Mod) return TypeTag::None;
+      break;
+    default:
+      return TypeTag::None;
+    }
+    return allOfType_(lhs, num, type)? type : TypeTag::None;
+  }
+  
+  template<class T>
+  inline T arithOp_(ArithOp op, T a, T b){
+    switch(op){
+    case ArithOp::Add:
+      return a + b;
+    case ArithOp::Sub:
+      return a - b;
+    case ArithOp::Mul:
+      return a * b;
+    default:
+      return a / b;
+    }
+  }
+  
+  template<class T>
+  inline bool cmpOp_(CmpMode mode, T a, T b){
+    switch(mode){
+    case CmpMode::Equal:
+      return a == b;
+    case CmpMode::NotEqual:
+      return a != b;
+    case CmpMode::Greater:
+      return a > b;
+    case CmpMode::Less:
+      return a < b;
+    case CmpMode::GreaterEqual:
+      return a >= b;
+    default:
+      return a <= b;
+    }
+  }
+  
+  /*
+    The scalar loops run from index first. rhs_step is 0 when rhs is broadcast.
+  */
+  template<class T>
+  void arithLoop_(
+    ArithOp op, TypeTag type, T Value::* field,
+    TypedValue* dst, const TypedValue* lhs, const TypedValue* rhs, int rhs_step,
+    size_t first, size_t num, bool reversed
+  ){
+    for(size_t i = first; i < num; ++i){
+      T a = lhs[i].value.*field;
+      T b = rhs[i * rhs_step].value.*field;
+      T res = reversed? arithOp_(op, b, a) : arithOp_(op, a, b);
+      dst[i].type = type;
+      dst[i].value.*field = res;
+    }
+  }
+  
+  template<class T>
+  void cmpLoop_(
+    CmpMode mode, T Value::* field,
+    TypedValue* dst, const TypedValue* lhs, const TypedValue* rhs, int rhs_step,
+    size_t first, size_t num
+  ){
+    for(size_t i = first; i < num; ++i){
+      bool res = cmpOp_(mode, lhs[i].value.*field, rhs[i * rhs_step].value.*field);
+      dst[i].type = TypeTag::Bool;
+      dst[i].value.int_v = 0;
+      dst[i].value.bool_v = res;
+    }
+  }
+  
+  #ifdef VALUE_KERNELS_X86
+  
+  //AVX2 kernels. They return the number of values processed, the remainder is
+  //left to the scalar loops.
+  
+  __attribute__((target("avx2")))
+  size_t arithAVX2_(
+    ArithOp op, TypeTag type,
+    TypedValue* dst, const TypedValue* lhs, const TypedValue* rhs, int rhs_step,
+    size_t num, bool reversed
+  ){
+    if(type == TypeTag::Int && op != ArithOp::Add && op != ArithOp::Sub) return 0;
+    
+    const __m256i tags = _mm256_set1_epi64x(static_cast<int64_t>(type));
+    const __m256i bcast = _mm256_set1_epi64x(rhs->value.int_v);
+    size_t i = 0;
+    for(; i + 2 <= num; i += 2){
+      __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(lhs + i));
+      __m256i b = rhs_step == 0?
+        bcast : _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rhs + i));
+      if(reversed) std::swap(a, b);
+      __m256i res;
+      if(type == TypeTag::Int){
+        res = op == ArithOp::Add? _mm256_add_epi64(a, b) : _mm256_sub_epi64(a, b);
+      }else{
+        __m256d fa = _mm256_castsi256_pd(a), fb = _mm256_castsi256_pd(b);
+        switch(op){
+        case ArithOp::Add:
+          res = _mm256_castpd_si256(_mm256_add_pd(fa, fb));
+          break;
+        case ArithOp::Sub:
+          res = _mm256_castpd_si256(_mm256_sub_pd(fa, fb));
+          break;
+        case ArithOp::Mul:
+          res = _mm256_castpd_si256(_mm256_mul_pd(fa, fb));
+          break;
+        default:
+          res = _mm256_castpd_si256(_mm256_div_pd(fa, fb));
+          break;
+        }
+      }
+      //tags in the even 64 bit lanes, results in the odd ones.
+      _mm256_storeu_si256(
+        reinterpret_cast<__m256i*>(dst + i),
+        _mm256_blend_epi32(tags, res, 0xcc)
+      );
+    }
+    return i;
+  }
+  
+  template<int Pred>
+  __attribute__((target("avx2")))
+  inline __m256i cmpFloatAVX2_(__m256i a, __m256i b){
+    return _mm256_castpd_si256(
+      _mm256_cmp_pd(_mm256_castsi256_pd(a), _mm256_castsi256_pd(b), Pred)
+    );
+  }
+  
+  __attribute__((target("avx2")))
+  size_t cmpAVX2_(
+    CmpMode mode, TypeTag type,
+    TypedValue* dst, const TypedValue* lhs, const TypedValue* rhs, int rhs_step,
+    size_t num
+  ){
+    const __m256i tags = _mm256_set1_epi64x(static_cast<int64_t>(TypeTag::Bool));
+    const __m256i ones = _mm256_set1_epi64x(-1);
+    const __m256i bcast = _mm256_set1_epi64x(rhs->value.int_v);
+    size_t i = 0;
+    for(; i + 2 <= num; i += 2){
+      __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(lhs + i));
+      __m256i b = rhs_step == 0?
+        bcast : _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rhs + i));
+      __m256i mask;
+      if(type == TypeTag::Int){
+        switch(mode){
+        case CmpMode::Equal:
+          mask = _mm256_cmpeq_epi64(a, b);
+          break;
+        case CmpMode::NotEqual:
+          mask = _mm256_xor_si256(_mm256_cmpeq_epi64(a, b), ones);
+          break;
+        case CmpMode::Greater:
+          mask = _mm256_cmpgt_epi64(a, b);
+          break;
+        case CmpMode::Less:
+          mask = _mm256_cmpgt_epi64(b, a);
+          break;
+        case CmpMode::GreaterEqual:
+          mask = _mm256_xor_si256(_mm256_cmpgt_epi64(b, a), ones);
+          break;
+        default:
+          mask = _mm256_xor_si256(_mm256_cmpgt_epi64(a, b), ones);
+          break;
+        }
+      }else{
+        switch(mode){
+        case CmpMode::Equal:
+          mask = cmpFloatAVX2_<_CMP_EQ_OQ>(a, b);
+          break;
+        case CmpMode::NotEqual:
+          mask = cmpFloatAVX2_<_CMP_NEQ_UQ>(a, b);
+          break;
+        case CmpMode::Greater:
+          mask = cmpFloatAVX2_<_CMP_GT_OQ>(a, b);
+          break;
+        case CmpMode::Less:
+          mask = cmpFloatAVX2_<_CMP_LT_OQ>(a, b);
+          break;
+        case CmpMode::GreaterEqual:
+          mask = cmpFloatAVX2_<_CMP_GE_OQ>(a, b);
+          break;
+        default:
+          mask = cmpFloatAVX2_<_CMP_LE_OQ>(a, b);
+          break;
+        }
+      }
+      _mm256_storeu_si256(
+        reinterpret_cast<__m256i*>(dst + i),
+        _mm256_blend_epi32(tags, _mm256_srli_epi64(mask, 63), 0xcc)
+      );
+    }
+    return i;
+  }
+  
+  #endif
+  
+  bool arith_(
+    ArithOp op, TypedValue* dst, const TypedValue* lhs, const TypedValue* rhs,
+    int rhs_step, size_t num, bool reversed
+  ){
+    TypeTag type = arithType_(op, lhs, num, rhs->type);
+    if(type == TypeTag::None) return false;
+    if(rhs_step != 0 && !allOfType_(rhs, num, type)) return false;
+    
+    size_t first = 0;
+    #ifdef VALUE_KERNELS_X86
+    if(dispatch_().avx2){
+      first = arithAVX2_(op, type, dst, lhs, rhs, rhs_step, num, reversed);
+    }
+    #endif
+    if(type == TypeTag::Int){
+      arithLoop_(op, type, &Value::int_v, dst, lhs, rhs, rhs_step, first, num, reversed);
+    }else{
+      arithLoop_(op, type, &Value::float_v, dst, lhs, rhs, rhs_step, first, num, reversed);
+    }
+    return true;
+  }
+  
+  bool compare_(
+    CmpMode mode, TypedValue* dst, const TypedValue* lhs, const TypedValue* rhs,
+    int rhs_step, size_t num
+  ){
+    if(num == 0) return false;
+    TypeTag type = lhs[0].type;
+    if(type != TypeTag::Int && type != TypeTag::Float) return false;
+    if(rhs->type != type || !allOfType_(lhs, num, type)) return false;
+    if(rhs_step != 0 && !allOfType_(rhs, num, type)) return false;
+    
+    size_t first = 0;
+    #ifdef VALUE_KERNELS_X86
+    if(dispatch_().avx2){
+      first = cmpAVX2_(mode, type, dst, lhs, rhs, rhs_step, num);
+    }
+    #endif
+    if(type == TypeTag::Int){
+      cmpLoop_(mode, &Value::int_v, dst, lhs, rhs, rhs_step, first, num);
+    }else{
+      cmpLoop_(mode, &Value::float_v, dst, lhs, rhs, rhs_step, first, num);
+    }
+    return true;
+  }
+}
+
+namespace ValueKernels {
+
+  ptrdiff_t indexOf(
+    const TypedValue* begin,
+    const TypedValue* end,
+    const TypedValue& needle
+  ){
+    switch(needleKind_(needle)){
+    case NeedleKind::Bitwise:
+      return dispatch_().index_of_bitwise(begin, end, needle);
+    case NeedleKind::Float:
+      return dispatch_().index_of_float(begin, end, needle);
+    default:
+      return indexOfScalar_(begin, end, needle);
+    }
+  }
+
+  bool equal(const TypedValue* lhs, const TypedValue* rhs, size_t num){
+    return dispatch_().equal(lhs, rhs, num);
+  }
+  
+  bool arith(
+    ArithOp op, TypedValue* dst, const TypedValue* lhs, const TypedValue* rhs, size_t num
+  ){
+    return arith_(op, dst, lhs, rhs, 1, num, false);
+  }
+  
+  bool arithScalar(
+    ArithOp op, TypedValue* dst, const TypedValue* lhs, const TypedValue& rhs, size_t num,
+    bool reversed
+  ){
+    return arith_(op, dst, lhs, &rhs, 0, num, reversed);
+  }
+  
+  bool compare(
+    CmpMode mode, TypedValue* dst, const TypedValue* lhs, const TypedValue* rhs, size_t num
+  ){
+    return compare_(mode, dst, lhs, rhs, 1, num);
+  }
+  
+  bool compareScalar(
+    CmpMode mode, TypedValue* dst, const TypedValue* lhs, const TypedValue& rhs, size_t num
+  ){
+    return compare_(mode, dst, lhs, &rhs, 0, num);
+  }
+}
+
+#else
+
+/*
+  The compact layout can not be compared bitwise, since large ints are boxed, and
+  the values are decoded one at a time anyway. Search and equality are plain loops,
+  and arithmetic is left to the scalar TypedValue operations.
+*/
+
+namespace ValueKernels {
+
+  ptrdiff_t indexOf(
+    const TypedValue* begin,
+    const TypedValue* end,
+    const TypedValue& needle
+  ){
+    for(auto it = begin; it != end; ++it){
+      if(*it == needle) return it - begin;
+    }
+    return -1;
+  }
+
+  bool equal(const TypedValue* lhs, const TypedValue* rhs, size_t num){
+    for(size_t i = 0; i < num; ++i){
+      if(memcmp(lhs + i, rhs + i, sizeof(TypedValue)) != 0 && !(lhs[i] == rhs[i])){
+        return false;
+      }
+    }
+    return true;
+  }
+  
+  bool arith(ArithOp, TypedValue*, const TypedValue*, const TypedValue*, size_t){
+    return false;
+  }
+  
+  bool arithScalar(
+    ArithOp, TypedValue*, const TypedValue*, const TypedValue&, size_t, bool
+  ){
+    return false;
+  }
+  
+  bool compare(CmpMode, TypedValue*, const TypedValue*, const TypedValue*, size_t){
+    return false;
+  }
+  
+  bool compareScalar(CmpMode, TypedValue*, const TypedValue*, const TypedValue&, size_t){
+    return false;
+  }
+}
+
+#endif
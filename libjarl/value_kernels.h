@@ -0,0 +1,79 @@
+#ifndef VALUE_KERNELS_H_INCLUDED
+#define VALUE_KERNELS_H_INCLUDED
+
+#include <cstddef>
+
+/*
+  Search and comparison kernels over contiguous runs of TypedValue.
+
+  On x86 the kernels are vectorized with SSE2, and with AVX2 when the cpu supports
+  it. The implementation is selected at runtime on first use. The kernels rely on
+  the layout of TypedValue being a one byte type tag and seven zero bytes followed by
+  an 8 byte value, so that ints, small strings and function and table references can
+  be compared bitwise 16 bytes at a time. Elements that need a semantic comparison
+  (bools, nulls, heap strings, nested arrays) are handed to the scalar
+  TypedValue::operator==.
+  
+  When built with NAN_BOXED_VALUES none of this holds. indexOf and equal are then
+  plain loops over operator==, and the arithmetic and comparison kernels always
+  return false.
+  
+  The arithmetic and comparison kernels only handle runs of values that are all ints
+  or all floats. For anything else they return false without writing to dst, and the
+  caller falls back to the scalar TypedValue operations.
+*/
+
+class TypedValue;
+enum class CmpMode;
+
+namespace ValueKernels {
+
+  /*
+    Returns the index of the first element in [begin, end) equal to needle, or -1 if
+    there is none.
+  */
+  ptrdiff_t indexOf(const TypedValue* begin, const TypedValue* end, const TypedValue& needle);
+
+  /*
+    Returns true if the two runs of num elements are element-wise equal.
+  */
+  bool equal(const TypedValue* lhs, const TypedValue* rhs, size_t num);
+  
+  enum class ArithOp{
+    Add,
+    Sub,
+    Mul,
+    Div,
+    Mod
+  };
+  
+  /*
+    Computes dst[i] = lhs[i] op rhs[i]. dst may alias lhs.
+  */
+  bool arith(
+    ArithOp, TypedValue* dst, const TypedValue* lhs, const TypedValue* rhs, size_t num
+  );
+  /*
+    Computes dst[i] = lhs[i] op rhs, or dst[i] = rhs op lhs[i] if reversed is set.
+    dst may alias lhs.
+  */
+  bool arithScalar(
+    ArithOp, TypedValue* dst, const TypedValue* lhs, const TypedValue& rhs, size_t num,
+    bool reversed
+  );
+  
+  /*
+    Computes dst[i] = lhs[i] mode rhs[i] as bools. dst may alias lhs.
+  */
+  bool compare(
+    CmpMode, TypedValue* dst, const TypedValue* lhs, const TypedValue* rhs, size_t num
+  );
+  /*
+    Computes dst[i] = lhs[i] mode rhs as bools. dst may alias lhs.
+  */
+  bool compareScalar(
+    CmpMode, TypedValue* dst, const TypedValue* lhs, const TypedValue& rhs, size_t num
+  );
+}
+
+#endif
@@ -7,7 +7,9 @@
 
 #include <algorithm>
 #include <iterator>
+#include <memory>
 #include <cassert>
+#include <cstring>
 
 #ifndef NDEBUG
 #include <cstdio>
@@ -91,46 +93,104 @@ void VM::doCmpOp_(const OpCodes::Type** iptr, CmpMode mode){
   }
 }
 
-void VM::pushFunction_(const Function& func){
-  #ifdef PRINT_OP
-  fprintf(stderr, "entering function %p\n", &func);
-  #endif
-  
+/*
+  Makes func the current frame, with its arguments starting at bp. The scratch
+  slots of the frame follow those of the calling frame.
+*/
+void VM::enterFrame_(const Function& func, unsigned bp){
+  unsigned sp = 0;
   if(this->frame_.func){
+    sp = this->frame_.sp + this->frame_.func->scratch;
     this->call_stack_.push_back(std::move(this->frame_));
   }
   this->frame_.func = &func;
   this->frame_.ip = func.getCode();
-  this->frame_.bp = this->stack_.size() - func.arguments - func.captures;
-  
-  std::copy(
-    func.getVValues().begin(),
-    func.getVValues().end(),
-    std::back_inserter(stack_)
+  this->frame_.bp = bp;
+  this->frame_.sp = sp;
+  this->frame_.borrowed = 0;
+  this->frame_.env = nullptr;
+  if(this->scratch_.size() < sp + func.scratch){
+    this->scratch_.resize(sp + func.scratch);
+  }
+}
+
+/*
+  Releases the scratch slots past KeptScratch_, or past those of the current
+  frame if it has more. Called when returning to the top level, so the slots of a
+  deep recursion do not keep their objects for the rest of the VM's life.
+*/
+void VM::trimScratch_(){
+  size_t keep = std::max<size_t>(
+    KeptScratch_,
+    this->frame_.sp + this->frame_.func->scratch
   );
-  stack_.resize(stack_.size() + func.locals);
+  if(this->scratch_.size() > keep){
+    this->scratch_.resize(keep);
+    this->scratch_.shrink_to_fit();
+  }
 }
 
-void VM::pushFunction_(const PartiallyApplied& part){
+/*
+  Releases the contents of the scratch slots of the current frame. Objects that
+  are still referred to elsewhere are given up.
+*/
+void VM::clearScratch_(){
+  for(unsigned i = 0; i < this->frame_.func->scratch; ++i){
+    TypedValue& slot = this->scratch_[this->frame_.sp + i];
+    switch(slot.type){
+    case TypeTag::Array:
+      if(slot.value.array_v->getRefCount() == 1) slot.value.array_v->clear();
+      else slot = nullptr;
+      break;
+    case TypeTag::Table:
+      if(slot.value.table_v->getRefCount() == 1) slot.value.table_v->clear();
+      else slot = nullptr;
+      break;
+    case TypeTag::Partial:
+      slot = nullptr;
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+/*
+  Resolves the arguments on top of the stack that the caller has lent, pushed
+  as borrows of its variables. The ones func never writes to are borrowed, leaving the reference
+  with the caller, and the rest are copied. With no func all of them are copied.
+  Returns the borrowed arguments, for StackFrame::borrowed of the callee.
+*/
+uint64_t VM::takeArguments_(const Function* func, int args){
+  uint64_t borrowable = func? func->borrowable : 0;
+  uint64_t borrowed = 0;
+  for(int i = 0; i < args; ++i){
+    TypedValue& arg = this->stack_[this->stack_.size() - args + i];
+    if(arg.type != TypeTag::Borrow) continue;
+    const TypedValue& lent = *arg.value.borrowed_v;
+    if(i < 64 && (borrowable >> i & 1)){
+      arg.borrowFrom(lent);
+      borrowed |= uint64_t(1) << i;
+    }else{
+      arg = lent;
+    }
+  }
+  return borrowed;
+}
+
+void VM::forgetBorrowed_(const StackFrame& frame){
+  for(uint64_t bits = frame.borrowed; bits != 0; bits &= bits - 1){
+    this->stack_[frame.bp + __builtin_ctzll(bits)].forget();
+  }
+}
+
+void VM::pushFunction_(const Function& func){
   #ifdef PRINT_OP
-  fprintf(stderr, "entering function %p\n", part.getFunc());
+  fprintf(stderr, "entering function %p\n", &func);
   #endif
   
-  assert(part.nargs == 0);
-  
-  if(this->frame_.func){
-    this->call_stack_.push_back(std::move(this->frame_));
-  }
-  const Function& func = *part.getFunc();
-  this->frame_.func = &func;
-  this->frame_.ip = func.getCode();
-  this->frame_.bp = this->stack_.size();
+  this->enterFrame_(func, this->stack_.size() - func.arguments);
   
-  std::copy(
-    part.cbegin(),
-    part.cend(),
-    std::back_inserter(stack_)
-  );
   std::copy(
     func.getVValues().begin(),
     func.getVValues().end(),
@@ -139,6 +199,10 @@ void VM::pushFunction_(const PartiallyApplied& part){
   stack_.resize(stack_.size() + func.locals);
 }
 
+/*
+  Enters the function of part, with the args arguments on top of the stack taking
+  the places part has left unbound.
+*/
 void VM::pushFunction_(const PartiallyApplied& part, int args){
   #ifdef PRINT_OP
   fprintf(stderr, "entering function %p\n", part.getFunc());
@@ -146,36 +210,22 @@ void VM::pushFunction_(const PartiallyApplied& part, int args){
   
   assert(part.nargs == args);
   
-  if(this->frame_.func){
-    this->call_stack_.push_back(std::move(this->frame_));
-  }
   const Function& func = *part.getFunc();
-  this->frame_.func = &func;
-  this->frame_.ip = func.getCode();
-  this->frame_.bp = this->stack_.size() - args;
+  this->enterFrame_(func, this->stack_.size() - args);
+  this->frame_.env = part.getEnv();
   
-  auto& vals = part.getArgs();
-  if(func.arguments != args){
-    stack_.resize(stack_.size() + func.arguments + func.captures - args);
-    TypedValue
-      *pos1 = &stack_.back() - 1,
-      *pos2 = &stack_.back() - 1 - part.nargs;
-    
-    for(int i = func.arguments; i > 0; --i){
-      if(vals[i].type == TypeTag::None){
-        *pos1 = std::move(*(pos2--));        
-      }else{
-        *pos1 = vals[i];
-      }
-      --pos1;
+  // filled from the back, so every argument on the stack moves up or stays
+  const unsigned bp = this->frame_.bp;
+  stack_.resize(bp + func.arguments);
+  for(int i = func.arguments - 1; i >= 0; --i){
+    const TypedValue& bound = part.getArgs()[i];
+    if(bound.type != TypeTag::None){
+      stack_[bp + i] = bound;
+    }else if(--args != i){
+      stack_[bp + i] = std::move(stack_[bp + args]);
     }
   }
   
-  std::copy(
-    std::next(vals.begin(), func.arguments),
-    vals.cend(),
-    std::back_inserter(stack_)
-  );
   std::copy(
     func.getVValues().begin(),
     func.getVValues().end(),
@@ -184,24 +234,66 @@ void VM::pushFunction_(const PartiallyApplied& part, int args){
   stack_.resize(stack_.size() + func.locals);
 }
 
+/*
+  Binds the n arguments on top of the stack to the function or partial below them,
+  which must take at least n. A partial that takes exactly n is entered without
+  binding them. Otherwise a partial that is shared is copied first, and the
+  arguments are bound to it in place. If that binds every argument the function
+  is entered, returning to return_ip, and true is returned.
+*/
+bool VM::applyArguments_(int n, const OpCodes::Type* return_ip){
+  const size_t args = this->stack_.size() - n;
+  TypedValue& callee = this->stack_[args - 1];
+  
+  if(callee.type == TypeTag::Func){
+    if(callee.value.func_v->arguments == n){
+      this->frame_.ip = return_ip;
+      this->pushFunction_(*callee.value.func_v);
+      return true;
+    }
+    callee.toPartial();
+  }else if(callee.value.partial_v->nargs == n){
+    this->frame_.ip = return_ip;
+    this->pushFunction_(*callee.value.partial_v, n);
+    return true;
+  }else if(callee.value.partial_v->getRefCount() > 1){
+    callee = new PartiallyApplied(*callee.value.partial_v);
+  }
+  
+  PartiallyApplied* part = callee.value.partial_v;
+  for(int i = 0; i < n; ++i){
+    part->apply(std::move(this->stack_[args + i]), 0);
+  }
+  this->stack_.resize(args);
+  if(part->nargs > 0) return false;
+  
+  this->frame_.ip = return_ip;
+  this->pushFunction_(*part);
+  return true;
+}
+
 bool VM::popFunction_(){
   #ifdef PRINT_OP
   fprintf(stderr, "leaving function %p\n", this->frame_.func);
   #endif
   
+  this->forgetBorrowed_(this->frame_);
   if(!this->call_stack_.empty()){
     if(this->stack_.size() > this->frame_.bp){
       this->stack_[this->frame_.bp - 1] = std::move(this->stack_.back());
       this->stack_.resize(this->frame_.bp);
     }
+    this->clearScratch_();
     this->frame_ = std::move(this->call_stack_.back());
     this->call_stack_.pop_back();
+    if(this->call_stack_.empty()) this->trimScratch_();
     return false;
   }else{
     if(this->stack_.size() > 1){
       this->stack_[0] = std::move(this->stack_.back());
       this->stack_.resize(1);
     }
+    this->clearScratch_();
     this->frame_.func = nullptr;
     return true;
   }
@@ -263,6 +355,20 @@ void VM::execute(const Function& func){
           if(*this->frame_.ip & OpCodes::Int){
             ++this->frame_.ip;
             stack_.emplace_back(static_cast<Int>(*this->frame_.ip));
+          }else if(*this->frame_.ip & OpCodes::Alt1){
+            // the last read of a variable, which gives up its value unless borrowed
+            bool lend = *this->frame_.ip & OpCodes::Alt2;
+            auto pos = *(++this->frame_.ip);
+            if(pos < 64 && (this->frame_.borrowed >> pos & 1)){
+              if(lend) stack_.emplace_back(&stack_[this->frame_.bp + pos]);
+              else stack_.push_back(stack_[this->frame_.bp + pos]);
+            }else{
+              stack_.push_back(std::move(stack_[this->frame_.bp + pos]));
+            }
+          }else if(*this->frame_.ip & OpCodes::Alt2){
+            // an argument lent to the callee, see takeArguments_
+            ++this->frame_.ip;
+            stack_.emplace_back(&stack_[this->frame_.bp + *this->frame_.ip]);
           }else{
             ++this->frame_.ip;
             stack_.push_back(stack_[this->frame_.bp + *this->frame_.ip]);
@@ -271,6 +377,10 @@ void VM::execute(const Function& func){
           stack_.emplace_back(nullptr);
         }
         break;
+      case OpCodes::PushCapture:
+        ++this->frame_.ip;
+        stack_.push_back((*this->frame_.env)[*this->frame_.ip]);
+        break;
       case OpCodes::PushTrue:
         assert((*this->frame_.ip & OpCodes::Extended) == 0);
         stack_.emplace_back(true);
@@ -287,6 +397,9 @@ void VM::execute(const Function& func){
           stack_.pop_back();
         }
         break;
+      case OpCodes::Swap:
+        std::swap(stack_[stack_.size() - 2], stack_.back());
+        break;
       case OpCodes::Reduce:
         if(*this->frame_.ip & OpCodes::Extended){
           ++this->frame_.ip;
@@ -455,7 +568,7 @@ void VM::execute(const Function& func){
             this->frame_.func->getCode() + (OpCodes::Type)*this->frame_.ip;
           goto loop_start;
         }else{
-          auto iter = stack_.back().value.iterator_v;
+          Iterator* iter = stack_.back().value.iterator_v;
           stack_[frame_.bp + *(frame_.ip - 3)] = iter->getKey();
           stack_[frame_.bp + *(frame_.ip - 2)] = iter->getValue();
           iter->advance();
@@ -463,7 +576,43 @@ void VM::execute(const Function& func){
         break;
       
       case OpCodes::Apply:
-        {
+        if(*this->frame_.ip & OpCodes::Alt1){
+          /*
+            Applies n arguments at once, then jumps past the single applies that
+            follow. Those are the way back if the callee takes fewer arguments: the
+            arguments after the first are then moved below the callee, in reverse,
+            for the applies to swap back up one at a time.
+          */
+          int n = *(++this->frame_.ip);
+          auto done = this->frame_.func->getCode() + *(++this->frame_.ip);
+          auto& callee = stack_[stack_.size() - 1 - n];
+          
+          int arity = 0;
+          if(callee.type == TypeTag::Func){
+            arity = callee.value.func_v->arguments;
+          }else if(callee.type == TypeTag::Partial){
+            arity = callee.value.partial_v->nargs;
+          }else{
+            D_errorJmpVargs(
+              1,
+              "Type error. Cannot bind argument to %s.",
+              callee.typeStr()
+            );
+          }
+          
+          if(arity >= n){
+            if(this->applyArguments_(n, done - 1)){
+              end_it = this->frame_.func->getCode() + this->frame_.func->getCodeSize();
+              goto loop_start;
+            }
+            this->frame_.ip = done - 1;
+          }else{
+            TypedValue* base = &callee;
+            std::reverse(base, base + n + 1);
+            std::swap(base[n - 1], base[n]);
+          }
+          break;
+        }else{
           auto& callee = stack_[stack_.size() - 2];
           int bind_pos = 0;
           
@@ -494,7 +643,9 @@ void VM::execute(const Function& func){
               D_errorJmpVargs(1, "Unable to bind argument to index %d.", bind_pos);
             }
             
-            callee = new PartiallyApplied(*callee.value.partial_v);
+            if(callee.value.partial_v->getRefCount() > 1){
+              callee = new PartiallyApplied(*callee.value.partial_v);
+            }
             callee.value.partial_v->apply(std::move(stack_.back()), bind_pos);
             this->stack_.pop_back();
             if(callee.value.partial_v->nargs == 0){
@@ -516,21 +667,35 @@ void VM::execute(const Function& func){
       case OpCodes::CreateClosure:
         {
           unsigned captures;
-          if((*this->frame_.ip & (OpCodes::Extended | OpCodes::Int))
+          TypedValue* slot = nullptr;
+          if(*this->frame_.ip & OpCodes::Alt1){
+            captures = *(++this->frame_.ip);
+            slot = &scratch_[frame_.sp + *(++this->frame_.ip)];
+          }else if((*this->frame_.ip & (OpCodes::Extended | OpCodes::Int))
           == (OpCodes::Extended | OpCodes::Int)){
             captures = *(++this->frame_.ip);
           }else{
             captures = 1;
           }
           
-          auto& callee = stack_[stack_.size() - captures - 1];
+          TypedValue* values = stack_.data() + stack_.size() - captures;
+          auto& callee = values[-1];
           assert(callee.type == TypeTag::Func);
           
-          callee.toPartial();
-          callee.value.partial_v->capture(
-            stack_.data() + stack_.size() - captures,
-            stack_.data() + stack_.size()
-          );
+          if(
+            slot != nullptr
+            && slot->type == TypeTag::Partial
+            && slot->value.partial_v->getFunc() == callee.value.func_v
+            && slot->value.partial_v->getEnv()->holds(values)
+          ){
+            callee = *slot;
+          }else{
+            callee = new PartiallyApplied(
+              callee.value.func_v,
+              new Environment(values, values + captures)
+            );
+            if(slot != nullptr) *slot = callee;
+          }
           stack_.resize(stack_.size() - captures);
           break;
         }
@@ -547,7 +712,9 @@ void VM::execute(const Function& func){
             if(callee.value.func_v->arguments != args){
               D_errorJmp(1, "Wrong number of arguments.");
             }
+            uint64_t borrowed = this->takeArguments_(callee.value.func_v, args);
             this->pushFunction_(*callee.value.func_v);
+            this->frame_.borrowed = borrowed;
             end_it = this->frame_.func->getCode()
               + this->frame_.func->getCodeSize();
             goto loop_start;
@@ -555,7 +722,8 @@ void VM::execute(const Function& func){
             if(callee.value.partial_v->nargs != args){
               D_errorJmp(1, "Wrong number of arguments.");
             }
-            this->pushFunction_(*callee.value.partial_v, args);
+            this->takeArguments_(nullptr, args);
+            this->applyArguments_(args, this->frame_.ip);
             end_it = this->frame_.func->getCode()
               + this->frame_.func->getCodeSize();
             goto loop_start;
@@ -575,10 +743,11 @@ void VM::execute(const Function& func){
           if(callee->arguments != args){
             D_errorJmp(1, "Wrong number of arguments.");
           }
-          for(int i = 0; i < callee->captures; ++i){
-            stack_.emplace_back(stack_[frame_.bp + args + i]);
-          }
+          uint64_t borrowed = this->takeArguments_(callee, args);
+          Environment* env = this->frame_.env.get();
           this->pushFunction_(*callee);
+          this->frame_.borrowed = borrowed;
+          this->frame_.env = env;
           end_it = this->frame_.func->getCode()
             + this->frame_.func->getCodeSize();
           goto loop_start;
@@ -604,7 +773,23 @@ void VM::execute(const Function& func){
         break;
       
       case OpCodes::CreateArray:
-        if(*this->frame_.ip & OpCodes::Extended){
+        if(*this->frame_.ip & OpCodes::Alt1){
+          // a temporary literal, refilling the object of its scratch slot
+          auto stack_pos = stack_.size() - *(++this->frame_.ip);
+          TypedValue& slot = scratch_[frame_.sp + *(++this->frame_.ip)];
+          if(slot.type == TypeTag::Array && slot.value.array_v->getRefCount() == 1){
+            slot.value.array_v->clear();
+          }else{
+            slot = new Array;
+          }
+          Array* arr = slot.value.array_v;
+          
+          for(auto i = stack_pos; i < stack_.size(); ++i){
+            arr->push_back(std::move(stack_[i]));
+          }
+          stack_.resize(stack_pos + 1);
+          stack_.back() = slot;
+        }else if(*this->frame_.ip & OpCodes::Extended){
           assert((*this->frame_.ip & OpCodes::Int) == OpCodes::Int);
           Array* arr = new Array;
           
@@ -621,7 +806,25 @@ void VM::execute(const Function& func){
         break;
       
       case OpCodes::CreateTable:
-        if(*this->frame_.ip & OpCodes::Extended){
+        if(*this->frame_.ip & OpCodes::Alt1){
+          auto stack_pos = stack_.size() - 2 * *(++this->frame_.ip);
+          TypedValue& slot = scratch_[frame_.sp + *(++this->frame_.ip)];
+          if(slot.type == TypeTag::Table && slot.value.table_v->getRefCount() == 1){
+            slot.value.table_v->clear();
+          }else{
+            slot = new Table;
+          }
+          Table* tab = slot.value.table_v;
+          
+          for(auto i = stack_pos; i < stack_.size(); i += 2){
+            if(!stack_[i].isHashable()){
+              D_errorJmp(1, "Invalid key type in table");
+            }
+            tab->insert(std::move(stack_[i]), std::move(stack_[i + 1]));
+          }
+          stack_.resize(stack_pos + 1);
+          stack_.back() = slot;
+        }else if(*this->frame_.ip & OpCodes::Extended){
           assert((*this->frame_.ip & OpCodes::Int) == OpCodes::Int);
           Table* tab = new Table;
           auto stack_pos = stack_.size() - 2 * *(++this->frame_.ip);
@@ -630,7 +833,7 @@ void VM::execute(const Function& func){
             if(!stack_[i].isHashable()){
               D_errorJmp(1, "Invalid key type in table");
             }
-            tab->insert({std::move(stack_[i]), std::move(stack_[i + 1])});
+            tab->insert(std::move(stack_[i]), std::move(stack_[i + 1]));
           }
           stack_.resize(stack_pos + 1);
           stack_.back() = tab;
@@ -693,15 +896,34 @@ void VM::execute(const Function& func){
             num = *this->frame_.ip;
           }else num = 1;
           
-          int it = stack_.size() - num;
-          auto msg = stack_[it].toCStr();
-          for(++it; it < stack_.size(); ++it){
-            char* new_msg = dynSprintf("%s%s",
-              msg.get(),
-              stack_[it].toCStr().release()
-            );
-            msg.reset(new_msg);
+          // the message is gathered in a single buffer, strings are written
+          // straight from their pieces
+          int first = stack_.size() - num;
+          std::vector<std::unique_ptr<char[]>> converted(num);
+          size_t len = 0;
+          for(int i = 0; i < num; ++i){
+            const auto& val = stack_[first + i];
+            if(val.type == TypeTag::String){
+              len += val.value.string_v->len();
+            }else{
+              converted[i] = val.toCStr();
+              len += strlen(converted[i].get());
+            }
           }
+          
+          std::unique_ptr<char[]> msg(new char[len + 1]);
+          char* dest = msg.get();
+          for(int i = 0; i < num; ++i){
+            if(converted[i]){
+              size_t part_len = strlen(converted[i].get());
+              memcpy(dest, converted[i].get(), part_len);
+              dest += part_len;
+            }else{
+              dest = stack_[first + i].value.string_v->write(dest);
+            }
+          }
+          *dest = '\0';
+          
           this->print(msg.get());
           stack_.resize(stack_.size() - num);
         }
@@ -746,7 +968,9 @@ void VM::execute(const Function& func){
       ++this->frame_.ip;
     }
   }else{
-    //nop for now
+    // the frames are left as they are, but borrowed arguments must not be released
+    this->forgetBorrowed_(this->frame_);
+    for(auto& frame: this->call_stack_) this->forgetBorrowed_(frame);
   }
   
   stack_.pop_back();
@@ -19,9 +19,16 @@ public:
     rc_ptr<const Function> func;
     const OpCodes::Type* ip;
     unsigned bp;
+    // the first scratch slot of the frame
+    unsigned sp;
+    // the arguments borrowed from the caller, see takeArguments_
+    uint64_t borrowed;
+    // the captures of the closure being called, if any
+    rc_ptr<Environment> env;
     
-    StackFrame(): func(nullptr), ip(nullptr), bp(0){}
-    StackFrame(const Function* p, unsigned b): func(p), ip(nullptr), bp(b){}
+    StackFrame(): func(nullptr), ip(nullptr), bp(0), sp(0), borrowed(0), env(nullptr){}
+    StackFrame(const Function* p, unsigned b)
+    : func(p), ip(nullptr), bp(b), sp(0), borrowed(0), env(nullptr){}
     
     StackFrame(StackFrame&&) = default;
     StackFrame& operator=(StackFrame&&) = default;
@@ -44,13 +51,30 @@ private:
   FixedVector<TypedValue> stack_;
   std::vector<StackFrame> call_stack_;
   
+  /*
+    Temporary array and table literals, which the code generator has found can not
+    escape the frame, are built in scratch slots of the frame. A slot keeps its
+    object after the frame exits, emptied, so a literal that is evaluated again
+    refills the same object instead of allocating a new one. A closure keeps the
+    last closure it created in a slot, which it pushes again as long as the
+    captured values stay the same.
+  */
+  std::vector<TypedValue> scratch_;
+  // the scratch slots kept when returning to the top level
+  static constexpr size_t KeptScratch_ = 64;
+  
   StackFrame frame_;
   
   void doArithOp_(const OpCodes::Type**, void (TypedValue::*)(const TypedValue&));
   void doCmpOp_(const OpCodes::Type**, CmpMode);
+  void enterFrame_(const Function&, unsigned);
+  void clearScratch_();
+  void trimScratch_();
+  uint64_t takeArguments_(const Function*, int);
+  void forgetBorrowed_(const StackFrame&);
   void pushFunction_(const Function&);
-  void pushFunction_(const PartiallyApplied&);
-  void pushFunction_(const PartiallyApplied&, int);
+  void pushFunction_(const PartiallyApplied&, int = 0);
+  bool applyArguments_(int, const OpCodes::Type*);
   bool popFunction_();
   
 public:
@@ -0,0 +1,91 @@
+#include "../libjarl/string.h"
+#include "../libjarl/table.h"
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+
+/*
+  Interns the same strings from several threads, while the other threads release
+  their references to them, so that strings are often found in the string table
+  while their last reference is being released. Tables are looked up with strings
+  that are not interned, which finds them in the string table without adding them.
+  
+  Built when THREAD_SAFE_REFCOUNTS is set, run it with the address or thread
+  sanitizer to catch strings used after they are released.
+*/
+
+namespace {
+  
+  constexpr unsigned Threads_ = 4;
+  constexpr int Rounds_ = 2000;
+  constexpr int Keys_ = 32;
+  
+  std::atomic<bool> failed_(false);
+  
+  void fail_(const char* msg, const String* str){
+    fprintf(stderr, "%s: '%.*s'\n", msg, str->len(), str->data());
+    failed_ = true;
+  }
+  
+  void run_(unsigned thread, const std::vector<std::string>& keys){
+    std::vector<String*> strings;
+    for(int round = 0; round < Rounds_ && !failed_; ++round){
+      //threads start at different keys, so the strings are released in a different
+      //order than they are interned
+      for(int i = 0; i < Keys_; ++i){
+        auto& key = keys[(i + thread * 7 + round) % Keys_];
+        String* str = make_new<String>(key.data(), static_cast<int>(key.size()))->intern();
+        if(!str->isInterned() || str->len() != (int)key.size()
+          || memcmp(str->data(), key.data(), key.size()) != 0){
+          fail_("interned string differs", str);
+        }
+        strings.push_back(str);
+      }
+      
+      Table table;
+      for(int i = 0; i < Keys_; i += 2){
+        table.findOrInsert(TypedValue(strings[i]));
+      }
+      for(int i = 0; i < Keys_; ++i){
+        auto& key = keys[(i + thread * 7 + round) % Keys_];
+        String* str = make_new<String>(key.data(), static_cast<int>(key.size()));
+        str->incRefCount();
+        if((table.find(TypedValue(str)) != nullptr) != (i % 2 == 0)){
+          fail_("table lookup failed", str);
+        }
+        str->decRefCount();
+      }
+      
+      for(auto str: strings){
+        str->decRefCount();
+      }
+      strings.clear();
+    }
+    //threads exit while the others still free strings from their pools, which
+    //orphans those pools
+  }
+}
+
+int main(){
+  std::vector<std::string> keys;
+  //long enough to not be stored inline in values
+  for(int i = 0; i < Keys_; ++i){
+    keys.push_back("a string interned by several threads, number " + std::to_string(i));
+  }
+  
+  std::vector<std::thread> threads;
+  for(unsigned t = 0; t < Threads_; ++t){
+    threads.emplace_back(run_, t, std::cref(keys));
+  }
+  for(auto& thread: threads){
+    thread.join();
+  }
+  
+  if(failed_) return 1;
+  printf("Success!\n");
+  return 0;
+}
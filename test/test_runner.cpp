@@ -2,15 +2,22 @@
 
 #include <memory>
 #include <cstdio>
+#include <cstring>
 
 bool fail = false;
 
+//a test starting with "//error: <text>" passes if it fails with an error starting with text
+const char* expected_error = nullptr;
+size_t expected_error_len = 0;
+
 void print(const char* str){
   printf("%s\n", str);
 }
 void errorPrint(const char* str){
   printf("%s\n", str);
-  fail = true;
+  if(expected_error != nullptr && strncmp(str, expected_error, expected_error_len) == 0){
+    expected_error = nullptr;
+  }else fail = true;
 }
 
 int main(int argc, char** argv){
@@ -34,11 +41,17 @@ int main(int argc, char** argv){
   buffer[len] = '\0';
   fclose(file);
   
+  const char prefix[] = "//error: ";
+  if(strncmp(buffer.get(), prefix, sizeof(prefix) - 1) == 0){
+    expected_error = buffer.get() + sizeof(prefix) - 1;
+    expected_error_len = strcspn(expected_error, "\n");
+  }
+  
   auto vm = jarl::new_vm();
   jarl::set_print_func(vm, print);
   jarl::set_error_print_func(vm, errorPrint);
   jarl::execute(vm, buffer.get());
   jarl::destroy_vm(vm);
   
-  return fail? 1 : 0;
+  return fail || expected_error != nullptr? 1 : 0;
 }
\ No newline at end of file